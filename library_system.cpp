@@ -5,15 +5,460 @@
 // - Virtual inheritance to resolve the diamond problem
 // - Abstract base classes and interfaces
 // - Simple object interactions (transactions, fees)
+// - Interned IDs (compact integer handles for hot paths)
+// - Columnar catalog storage for full-catalog scans
+// - Batch late-fee computation with runtime SIMD dispatch
+// - Fixed-point money (exact cents) for balances and fees
+// - Lock-free concurrent balance ledger
+// - Arena allocation for users and items (allocator_arg constructors)
+// - Hash-indexed user directory and item catalog (lookup by ID)
+// - Allocation-free report rendering (render() mirrors display())
+// - Memory-mapped binary snapshots of users and items
+// - Parallel CSV bulk import of users and items
+// - Write-ahead log with group commit for processed transactions
+// - Parallel log replay to rebuild balances
+// - Lock-free active-loan index enforcing Student borrow limits
+// - Due dates with a hierarchical timer wheel (automatic days late)
+// - Incremental accrual of pending late fees on overdue loans
+// - Inverted full-text index over item titles
+// - Trigram substring search over user names and emails
+// - Closed item kinds as std::variant with constexpr per-kind traits
+// - Flat trivially-copyable user records with class adapters
+// - Work-stealing transaction executor with per-borrower ordering
+// - epoll request server with a pipelined binary protocol
+// - Coroutine staged pipeline for returns (C++20 builds)
+// - Self-test build checking optimized paths against reference code
 // ============================================================================
 
 #include <iostream>
 #include <vector>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <iomanip>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <stdexcept>
+#include <memory_resource>
+#include <type_traits>
+#include <charconv>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstdio>
+#include <csignal>
+#include <utility>
+#include <thread>
+#include <condition_variable>
+#include <array>
+#include <optional>
+#include <functional>
+#include <map>
+#include <variant>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#endif
+#include <fstream>
+#include <sstream>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LIBRARY_X86_DISPATCH 1
+#endif
 using namespace std;
 
+// ============================================================================
+// Value Type: IdHandle
+// Compact 32-bit handle for an interned ID such as "S100" or "B001".
+// Two handles are equal exactly when their ID strings are equal.
+// Handle 0 is reserved and never refers to an ID.
+// ============================================================================
+struct IdHandle {
+uint32_t value = 0;
+
+bool valid() const noexcept { return value != 0; }
+
+friend bool operator==(IdHandle a, IdHandle b) noexcept { return a.value == b.value; }
+friend bool operator!=(IdHandle a, IdHandle b) noexcept { return a.value != b.value; }
+friend bool operator<(IdHandle a, IdHandle b) noexcept  { return a.value < b.value; }
+};
+
+// ============================================================================
+// Value Type: TextHandle
+// 32-bit handle for interned free text (user names, emails) in a
+// TextPool. A separate type from IdHandle, so text never lands in, or is
+// looked up as, the ID space. Handle 0 is reserved.
+// ============================================================================
+struct TextHandle {
+uint32_t value = 0;
+
+bool valid() const noexcept { return value != 0; }
+
+friend bool operator==(TextHandle a, TextHandle b) noexcept { return a.value == b.value; }
+friend bool operator!=(TextHandle a, TextHandle b) noexcept { return a.value != b.value; }
+};
+
+// ============================================================================
+// Class: InternTable<Handle>
+// Intern table mapping strings to handles and back. global() is the
+// process-wide table for each handle type (IdTable for IDs); a TextPool
+// for names and emails is normally owned by the table of records that
+// uses it, so its strings are freed with that table.
+// Strings are stored once and never move, so views stay valid for the
+// lifetime of the table. Interning is thread-safe.
+// Handle -> string lookups never lock: each handle's view is written once
+// into a fixed chunk before the handle count is published (release), and
+// chunks are never moved or freed, so readers only need an acquire load.
+// ============================================================================
+template <typename Handle>
+class InternTable {
+public:
+InternTable() : chunks_(make_unique<atomic<string_view*>[]>(kMaxChunks)) { // reserve handle 0
+    names_.emplace_back();
+    publish(names_.back());
+}
+
+InternTable(const InternTable&) = delete;
+InternTable& operator=(const InternTable&) = delete;
+
+static InternTable& global() {
+    static InternTable table;
+    return table;
+}
+
+// Return the handle for `text`, adding it on first sight
+Handle intern(string_view text) {
+    lock_guard<mutex> lock(mutex_);
+    auto found = index_.find(text);
+    if (found != index_.end()) return found->second;
+
+    if (names_.size() >= size_t(kMaxChunks) << kChunkBits)
+        throw length_error("InternTable: handle space exhausted");
+    names_.emplace_back(text);
+    Handle handle{static_cast<uint32_t>(names_.size() - 1)};
+    index_.emplace(names_.back(), handle);
+    publish(names_.back());
+    return handle;
+}
+
+// Return the handle for `text` without adding it (invalid if unknown)
+Handle lookup(string_view text) const {
+    lock_guard<mutex> lock(mutex_);
+    auto found = index_.find(text);
+    return found != index_.end() ? found->second : Handle{};
+}
+
+// Return the string behind a handle (lock-free)
+string_view name(Handle handle) const noexcept {
+    if (handle.value >= published_.load(memory_order_acquire)) return string_view();
+    return chunks_[handle.value >> kChunkBits].load(memory_order_relaxed)[handle.value & kChunkMask];
+}
+
+// Number of handles issued so far (including the reserved handle 0)
+size_t size() const noexcept { return published_.load(memory_order_acquire); }
+
+
+private:
+static constexpr uint32_t kChunkBits = 12;
+static constexpr uint32_t kChunkMask = (1u << kChunkBits) - 1;
+static constexpr uint32_t kMaxChunks = 1u << 16; // 2^28 handles
+
+// Store the view for the next handle, then make it visible (mutex_ held)
+void publish(string_view text) {
+    uint32_t value = published_.load(memory_order_relaxed);
+    uint32_t chunk = value >> kChunkBits;
+    if (!chunks_[chunk].load(memory_order_relaxed)) {
+        ownedChunks_.push_back(make_unique<string_view[]>(size_t(kChunkMask) + 1));
+        chunks_[chunk].store(ownedChunks_.back().get(), memory_order_relaxed);
+    }
+    chunks_[chunk].load(memory_order_relaxed)[value & kChunkMask] = text;
+    published_.store(value + 1, memory_order_release);
+}
+
+mutable mutex mutex_;                       // serializes intern() and lookup()
+deque<string> names_;                       // stable storage, indexed by handle
+unordered_map<string_view, Handle> index_;  // keys view into names_
+vector<unique_ptr<string_view[]>> ownedChunks_;
+unique_ptr<atomic<string_view*>[]> chunks_; // kMaxChunks entries (512 KiB), kept off the stack
+atomic<uint32_t> published_{0};             // handles readable by name()
+};
+
+using IdTable = InternTable<IdHandle>;
+using TextPool = InternTable<TextHandle>;
+
+// ============================================================================
+// Class: LazyIdHandle
+// An object's IdHandle, interned on first request rather than at
+// construction, so creating users and items (in bulk, or in a
+// LibraryArena) never touches the global IdTable. Concurrent first calls
+// intern the same text and store the same value, so the race is benign.
+// ============================================================================
+class LazyIdHandle {
+public:
+LazyIdHandle() = default;
+LazyIdHandle(const LazyIdHandle& other) noexcept : value_(other.value_.load(memory_order_relaxed)) {}
+LazyIdHandle& operator=(const LazyIdHandle& other) noexcept {
+    value_.store(other.value_.load(memory_order_relaxed), memory_order_relaxed);
+    return *this;
+}
+
+// `id` must be the same text on every call
+IdHandle get(string_view id) const noexcept {
+    uint32_t value = value_.load(memory_order_acquire);
+    if (value == 0) {
+        value = IdTable::global().intern(id).value;
+        value_.store(value, memory_order_release);
+    }
+    return IdHandle{value};
+}
+
+
+private:
+mutable atomic<uint32_t> value_{0}; // 0 = not interned yet
+};
+
+// ============================================================================
+// Class: HandleArray<T>
+// Array indexed by IdHandle value that grows on demand without moving:
+// slots live in fixed chunks allocated on first touch and installed with
+// a CAS, so lock-free code can hold references to slots while the array
+// grows. Slots start value-initialized (zero). Covers IdTable's whole
+// handle space, so tables built on it never need a capacity up front.
+// The chunk directory (128 KiB of pointers) is allocated on the heap, so
+// objects holding HandleArrays stay small enough to live on the stack.
+// ============================================================================
+template <typename T>
+class HandleArray {
+public:
+// Pre-allocate the chunks for handles below `initialSize`
+explicit HandleArray(size_t initialSize = 0) : chunks_(make_unique<atomic<T*>[]>(kChunkCount)) {
+    for (size_t index = 0; index < initialSize && index < kMaxSlots; index += kChunkSize)
+        (*this)[static_cast<uint32_t>(index)];
+}
+
+HandleArray(const HandleArray&) = delete;
+HandleArray& operator=(const HandleArray&) = delete;
+
+~HandleArray() {
+    for (uint32_t c = 0; c < kChunkCount; ++c) delete[] chunks_[c].load(memory_order_relaxed);
+}
+
+// Slot for `index`, allocating its chunk if needed
+T& operator[](uint32_t index) {
+    if (index >= kMaxSlots) throw out_of_range("HandleArray: index outside handle space");
+    atomic<T*>& chunk = chunks_[index >> kChunkBits];
+    T* slots = chunk.load(memory_order_acquire);
+    if (!slots) {
+        T* fresh = new T[kChunkSize]();
+        if (chunk.compare_exchange_strong(slots, fresh, memory_order_acq_rel)) slots = fresh;
+        else delete[] fresh; // another thread installed it first
+    }
+    return slots[index & kChunkMask];
+}
+
+// Slot for `index`, or nullptr if its chunk was never touched
+const T* find(uint32_t index) const noexcept {
+    if (index >= kMaxSlots) return nullptr;
+    T* slots = chunks_[index >> kChunkBits].load(memory_order_acquire);
+    return slots ? &slots[index & kChunkMask] : nullptr;
+}
+
+T* find(uint32_t index) noexcept {
+    return const_cast<T*>(static_cast<const HandleArray&>(*this).find(index));
+}
+
+
+private:
+static constexpr uint32_t kChunkBits = 14;
+static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+static constexpr uint32_t kChunkMask = kChunkSize - 1;
+static constexpr uint32_t kMaxSlots = 1u << 28; // IdTable's handle space
+static constexpr uint32_t kChunkCount = kMaxSlots >> kChunkBits;
+
+unique_ptr<atomic<T*>[]> chunks_; // kChunkCount entries, null until first touch
+};
+
+// ============================================================================
+// Value Type: Money
+// Fixed-point currency amount stored as a whole number of cents (int64).
+// Sums are exact, so batch and parallel ledgers can add fees in any order
+// and still reproduce the serial result.
+// Rounding rule: converting from a double rounds to the nearest cent,
+// halves away from zero (2.675 -> 2.68 only if the double is >= 2.675).
+// ============================================================================
+class Money {
+public:
+constexpr Money() noexcept = default;
+
+static constexpr Money fromCents(int64_t cents) noexcept { return Money(cents); }
+static Money fromDouble(double amount) noexcept { return Money(llround(amount * 100.0)); }
+
+constexpr int64_t cents() const noexcept { return cents_; }
+double toDouble() const noexcept         { return cents_ / 100.0; }
+
+constexpr Money& operator+=(Money other) noexcept { cents_ += other.cents_; return *this; }
+constexpr Money& operator-=(Money other) noexcept { cents_ -= other.cents_; return *this; }
+
+friend constexpr Money operator+(Money a, Money b) noexcept { return Money(a.cents_ + b.cents_); }
+friend constexpr Money operator-(Money a, Money b) noexcept { return Money(a.cents_ - b.cents_); }
+friend constexpr Money operator*(Money a, int64_t n) noexcept { return Money(a.cents_ * n); }
+friend constexpr Money operator*(int64_t n, Money a) noexcept { return Money(a.cents_ * n); }
+
+friend constexpr bool operator==(Money a, Money b) noexcept { return a.cents_ == b.cents_; }
+friend constexpr bool operator!=(Money a, Money b) noexcept { return a.cents_ != b.cents_; }
+friend constexpr bool operator<(Money a, Money b) noexcept  { return a.cents_ < b.cents_; }
+friend constexpr bool operator>(Money a, Money b) noexcept  { return a.cents_ > b.cents_; }
+friend constexpr bool operator<=(Money a, Money b) noexcept { return a.cents_ <= b.cents_; }
+friend constexpr bool operator>=(Money a, Money b) noexcept { return a.cents_ >= b.cents_; }
+
+// Prints like the double it represents, so existing stream formatting applies
+friend ostream& operator<<(ostream& os, Money m) { return os << m.toDouble(); }
+
+
+private:
+constexpr explicit Money(int64_t cents) noexcept : cents_(cents) {}
+
+int64_t cents_ = 0;
+};
+
+// ============================================================================
+// Value Type: Discount
+// Fee multiplier stored in basis points (10000 = pay full price).
+// Rounding rules:
+// - A double factor converts to the nearest basis point, e.g. 0.85 -> 8500
+//   and 0.12345 -> 1235 (reported back as 0.1235). fromFactor() clamps to
+//   [0, 1]; Student rejects factors outside that range instead
+// - Applying a discount to an amount rounds to the nearest cent, halves
+//   away from zero:  |result| = (|cents| * bp + 5000) / 10000
+// Every path (single, batch, SIMD) applies exactly this integer formula.
+// ============================================================================
+class Discount {
+public:
+static constexpr uint32_t kScale = 10000;
+
+constexpr Discount() noexcept = default; // no discount
+
+static constexpr Discount fromBasisPoints(uint32_t bp) noexcept {
+    return Discount(bp > kScale ? kScale : bp);
+}
+static Discount fromFactor(double factor) noexcept {
+    long bp = lround(factor * kScale);
+    return fromBasisPoints(static_cast<uint32_t>(bp < 0 ? 0 : bp));
+}
+
+constexpr uint32_t basisPoints() const noexcept { return bp_; }
+double factor() const noexcept                  { return double(bp_) / kScale; }
+
+constexpr Money apply(Money amount) const noexcept {
+    int64_t cents = amount.cents();
+    int64_t magnitude = (cents < 0 ? -cents : cents) * bp_;
+    int64_t rounded = (magnitude + kScale / 2) / kScale;
+    return Money::fromCents(cents < 0 ? -rounded : rounded);
+}
+
+
+private:
+constexpr explicit Discount(uint32_t bp) noexcept : bp_(bp) {}
+
+uint32_t bp_ = kScale;
+};
+
+// ============================================================================
+// Class: ReportBuffer
+// Reusable output buffer for large reports.
+// Text and numbers are appended without locale or iostream overhead
+// (numbers via std::to_chars) and written to a file descriptor in large
+// write() calls. Numbers are formatted exactly like a default-formatted
+// ostream (doubles as %g with 6 significant digits), so render() output
+// is byte-for-byte identical to display().
+// ============================================================================
+class ReportBuffer {
+public:
+explicit ReportBuffer(int fd = STDOUT_FILENO, size_t capacity = 64 * 1024)
+: fd_(fd), data_(make_unique<char[]>(capacity)), capacity_(capacity) {}
+
+ReportBuffer(const ReportBuffer&) = delete;
+ReportBuffer& operator=(const ReportBuffer&) = delete;
+
+~ReportBuffer() { flush(); }
+
+ReportBuffer& append(string_view text) {
+    if (text.size() > capacity_ - size_) {
+        flush();
+        if (text.size() > capacity_) return writeAll(text.data(), text.size()), *this;
+    }
+    memcpy(data_.get() + size_, text.data(), text.size());
+    size_ += text.size();
+    return *this;
+}
+
+ReportBuffer& append(char c) {
+    if (size_ == capacity_) flush();
+    data_[size_++] = c;
+    return *this;
+}
+
+ReportBuffer& append(int64_t value) {
+    char digits[24];
+    auto result = to_chars(digits, digits + sizeof(digits), value);
+    return append(string_view(digits, result.ptr - digits));
+}
+ReportBuffer& append(int value) { return append(static_cast<int64_t>(value)); }
+
+ReportBuffer& append(double value) {
+    char digits[32];
+    auto result = to_chars(digits, digits + sizeof(digits), value, chars_format::general, 6);
+    return append(string_view(digits, result.ptr - digits));
+}
+ReportBuffer& append(Money value) { return append(value.toDouble()); }
+
+// Text appended but not yet written
+string_view pending() const noexcept { return string_view(data_.get(), size_); }
+
+// Write everything buffered so far. cout is flushed first so text already
+// sent through iostreams stays in order on stdout.
+void flush() {
+    if (size_ == 0) return;
+    writeAll(data_.get(), size_);
+    size_ = 0;
+}
+
+// Drop buffered text without writing it
+void clear() noexcept { size_ = 0; }
+
+
+private:
+void writeAll(const char* data, size_t length) {
+    if (fd_ == STDOUT_FILENO) cout.flush();
+    while (length > 0) {
+        ssize_t written = ::write(fd_, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return; // report output is best-effort, like an unchecked cout
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+}
+
+int fd_;
+unique_ptr<char[]> data_;
+size_t capacity_;
+size_t size_ = 0;
+};
+
 // ============================================================================
 // Interface: Identifiable
 // Every class that needs a unique ID inherits from this.
@@ -22,6 +467,21 @@ class Identifiable {
 public:
 virtual ~Identifiable() = default;
 virtual string id() const noexcept = 0; // returns unique identifier
+
+// Allocation-free variants for hot paths
+virtual string_view idView() const noexcept = 0; // view of the unique identifier
+virtual IdHandle idHandle() const noexcept = 0;  // interned handle of the identifier
+};
+
+// ============================================================================
+// Enum: PersonRole
+// Role bits cached on every Person so hot paths can test roles without RTTI.
+// TeachingAssistant carries both bits.
+// ============================================================================
+enum PersonRole : uint8_t {
+    RoleNone    = 0,
+    RoleStudent = 1 << 0,
+    RoleStaff   = 1 << 1,
 };
 
 // ============================================================================
@@ -31,26 +491,48 @@ virtual string id() const noexcept = 0; // returns unique identifier
 // ============================================================================
 class Person : public virtual Identifiable {
 public:
-Person(string personId, string name, string email, double balance = 0.0)
-: personId_(move(personId)), name_(move(name)), email_(move(email)), balance_(balance) {}
+// Strings are allocated from this allocator (see LibraryArena)
+using allocator_type = pmr::polymorphic_allocator<char>;
+
+Person(string_view personId, string_view name, string_view email, double balance = 0.0)
+: Person(allocator_arg, allocator_type(), personId, name, email, balance) {}
+
+Person(allocator_arg_t, allocator_type alloc,
+string_view personId, string_view name, string_view email, double balance = 0.0)
+: personId_(personId, alloc), name_(name, alloc), email_(email, alloc),
+balance_(Money::fromDouble(balance)) {}
 
 
 // Implement ID access from Identifiable interface
-string id() const noexcept override       { return personId_; }
-string getName() const noexcept           { return name_; }
-string getEmail() const noexcept          { return email_; }
-double getBalance() const noexcept        { return balance_; }
+string id() const noexcept override       { return string(personId_); }
+string_view idView() const noexcept override { return personId_; }
+IdHandle idHandle() const noexcept override  { return handle_.get(personId_); }
+string getName() const noexcept           { return string(name_); }
+string getEmail() const noexcept          { return string(email_); }
+Money getBalance() const noexcept         { return balance_; }
+
+// Role tags and effective fee discount, filled in by derived constructors
+uint8_t roles() const noexcept            { return roles_; }
+bool hasRole(PersonRole role) const noexcept { return (roles_ & role) != 0; }
+bool hasPurchaseApproval() const noexcept { return canApprovePurchases_; } // Staff only
+Discount feeDiscount() const noexcept     { return feeDiscount_; }
+
+// Most items this user may hold at once (only Students are limited)
+static constexpr uint32_t kUnlimitedBorrows = UINT32_MAX;
+uint32_t borrowLimit() const noexcept     { return borrowLimit_; }
 
 // Add funds to the user's balance
-void addFunds(double amount) noexcept {
-    if (amount > 0) balance_ += amount;
+void addFunds(Money amount) noexcept {
+    if (amount > Money()) balance_ += amount;
 }
+void addFunds(double amount) noexcept { addFunds(Money::fromDouble(amount)); }
 
 // Deduct money for charges (never allow negative balance)
-void deduct(double amount) noexcept {
+void deduct(Money amount) noexcept {
     balance_ -= amount;
-    if (balance_ < 0) balance_ = 0;
+    if (balance_ < Money()) balance_ = Money();
 }
+void deduct(double amount) noexcept { deduct(Money::fromDouble(amount)); }
 
 // Display user information (virtual to support polymorphism)
 virtual void display() const {
@@ -58,12 +540,23 @@ virtual void display() const {
          << " | Balance: " << balance_ << "\n";
 }
 
+// Same text as display(), appended to a ReportBuffer
+virtual void render(ReportBuffer& out) const {
+    out.append(name_).append(" (").append(personId_).append(") | Email: ").append(email_)
+       .append(" | Balance: ").append(balance_).append('\n');
+}
+
 
 protected:
-string personId_;
-string name_;
-string email_;
-double balance_;
+pmr::string personId_;
+pmr::string name_;
+pmr::string email_;
+Money balance_;
+LazyIdHandle handle_;
+uint8_t roles_ = RoleNone;
+bool canApprovePurchases_ = false;
+Discount feeDiscount_;     // multiplier applied to late fees
+uint32_t borrowLimit_ = kUnlimitedBorrows;
 };
 
 // ============================================================================
@@ -72,27 +565,48 @@ double balance_;
 // ============================================================================
 class Student : public virtual Person {
 public:
-Student(string personId, string name, string email,
+Student(string_view personId, string_view name, string_view email,
 double balance, int maxConcurrentBorrows = 2, double discountFactor = 0.8)
-: Person(move(personId), move(name), move(email), balance),
+: Student(allocator_arg, allocator_type(), personId, name, email, balance,
+          maxConcurrentBorrows, discountFactor) {}
+
+Student(allocator_arg_t, allocator_type alloc,
+string_view personId, string_view name, string_view email,
+double balance, int maxConcurrentBorrows = 2, double discountFactor = 0.8)
+: Person(allocator_arg, alloc, personId, name, email, balance),
 maxConcurrentBorrows_(maxConcurrentBorrows),
-discountFactor_(discountFactor) {}
+discount_(Discount::fromFactor(discountFactor)) {
+    if (maxConcurrentBorrows < 0)
+        throw invalid_argument("Student: negative borrow limit for " + string(personId));
+    if (!(discountFactor >= 0.0 && discountFactor <= 1.0))
+        throw invalid_argument("Student: discount factor outside [0, 1] for " + string(personId));
+    roles_ |= RoleStudent;
+    feeDiscount_ = discount_;
+    borrowLimit_ = static_cast<uint32_t>(maxConcurrentBorrows);
+}
 
 
 int getMaxConcurrentBorrows() const noexcept { return maxConcurrentBorrows_; }
-double getDiscountFactor() const noexcept    { return discountFactor_; }
+double getDiscountFactor() const noexcept    { return discount_.factor(); }
+Discount getDiscount() const noexcept        { return discount_; }
 
 // Override display — include student details
 void display() const override {
     Person::display();
     cout << "  Role: Student | MaxBorrows: " << maxConcurrentBorrows_
-         << " | Discount: " << discountFactor_ << "\n";
+         << " | Discount: " << discount_.factor() << "\n";
+}
+
+void render(ReportBuffer& out) const override {
+    Person::render(out);
+    out.append("  Role: Student | MaxBorrows: ").append(maxConcurrentBorrows_)
+       .append(" | Discount: ").append(discount_.factor()).append('\n');
 }
 
 
 protected:
 int maxConcurrentBorrows_;
-double discountFactor_;
+Discount discount_;
 };
 
 // ============================================================================
@@ -101,13 +615,19 @@ double discountFactor_;
 // ============================================================================
 class Staff : public virtual Person {
 public:
-Staff(string personId, string name, string email, double balance,
+Staff(string_view personId, string_view name, string_view email, double balance,
 bool canApprovePurchases = false)
-: Person(move(personId), move(name), move(email), balance),
-canApprovePurchases_(canApprovePurchases) {}
+: Staff(allocator_arg, allocator_type(), personId, name, email, balance,
+        canApprovePurchases) {}
 
+Staff(allocator_arg_t, allocator_type alloc,
+string_view personId, string_view name, string_view email, double balance,
+bool canApprovePurchases = false)
+: Person(allocator_arg, alloc, personId, name, email, balance) {
+    roles_ |= RoleStaff;
+    canApprovePurchases_ = canApprovePurchases;
+}
 
-bool hasPurchaseApproval() const noexcept { return canApprovePurchases_; }
 
 // Override display
 void display() const override {
@@ -116,9 +636,11 @@ void display() const override {
          << (canApprovePurchases_ ? "Yes" : "No") << "\n";
 }
 
-
-protected:
-bool canApprovePurchases_;
+void render(ReportBuffer& out) const override {
+    Person::render(out);
+    out.append("  Role: Staff | PurchaseApproval: ")
+       .append(canApprovePurchases_ ? "Yes" : "No").append('\n');
+}
 };
 
 // ============================================================================
@@ -129,49 +651,99 @@ bool canApprovePurchases_;
 // ============================================================================
 class TeachingAssistant : public Student, public Staff {
 public:
-TeachingAssistant(string personId, string name, string email,
+TeachingAssistant(string_view personId, string_view name, string_view email,
+double balance, int maxConcurrentBorrows,
+double discountFactor, bool canApprovePurchases)
+: TeachingAssistant(allocator_arg, allocator_type(), personId, name, email, balance,
+                    maxConcurrentBorrows, discountFactor, canApprovePurchases) {}
+
+TeachingAssistant(allocator_arg_t, allocator_type alloc,
+string_view personId, string_view name, string_view email,
 double balance, int maxConcurrentBorrows,
 double discountFactor, bool canApprovePurchases)
-: Person(move(personId), move(name), move(email), balance),
-Student(personId_, name_, email_, balance, maxConcurrentBorrows, discountFactor),
-Staff(personId_, name_, email_, balance, canApprovePurchases) {}
+: Person(allocator_arg, alloc, personId, name, email, balance),
+Student(allocator_arg, alloc, personId_, name_, email_, balance, maxConcurrentBorrows, discountFactor),
+Staff(allocator_arg, alloc, personId_, name_, email_, balance, canApprovePurchases) {}
 
 
 void display() const override {
     Person::display();
     cout << "  Role: TeachingAssistant"
          << " | MaxBorrows: " << maxConcurrentBorrows_
-         << " | Discount: " << discountFactor_
+         << " | Discount: " << discount_.factor()
          << " | PurchaseApproval: " << (canApprovePurchases_ ? "Yes" : "No")
          << "\n";
 }
 
+void render(ReportBuffer& out) const override {
+    Person::render(out);
+    out.append("  Role: TeachingAssistant | MaxBorrows: ").append(maxConcurrentBorrows_)
+       .append(" | Discount: ").append(discount_.factor())
+       .append(" | PurchaseApproval: ").append(canApprovePurchases_ ? "Yes" : "No")
+       .append('\n');
+}
+
 
 };
 
+// ============================================================================
+// Enum: ItemKind
+// The closed set of concrete LibraryItem types, with their per-kind constants.
+// ============================================================================
+enum class ItemKind : uint8_t { Book, Magazine, DVD };
+
+constexpr string_view kindName(ItemKind kind) noexcept {
+    switch (kind) {
+    case ItemKind::Book:     return "Book";
+    case ItemKind::Magazine: return "Magazine";
+    case ItemKind::DVD:      return "DVD";
+    }
+    return "";
+}
+
+constexpr Money kindFeePerDay(ItemKind kind) noexcept {
+    switch (kind) {
+    case ItemKind::Book:     return Money::fromCents(100);
+    case ItemKind::Magazine: return Money::fromCents(50);
+    case ItemKind::DVD:      return Money::fromCents(200);
+    }
+    return Money();
+}
+
 // ============================================================================
 // Abstract Class: LibraryItem
 // Base type for ANY library object that can be borrowed.
 // ============================================================================
 class LibraryItem : public Identifiable {
 public:
-LibraryItem(string id, string title, double lateFeePerDay)
-: itemId_(move(id)), title_(move(title)), lateFeePerDay_(lateFeePerDay) {}
+// Strings are allocated from this allocator (see LibraryArena)
+using allocator_type = pmr::polymorphic_allocator<char>;
+
+LibraryItem(string_view id, string_view title, Money lateFeePerDay)
+: LibraryItem(allocator_arg, allocator_type(), id, title, lateFeePerDay) {}
+
+LibraryItem(allocator_arg_t, allocator_type alloc,
+string_view id, string_view title, Money lateFeePerDay)
+: itemId_(id, alloc), title_(title, alloc), lateFeePerDay_(lateFeePerDay) {}
 
 
-string id() const noexcept override       { return itemId_; }
-string getTitle() const noexcept          { return title_; }
-double lateFeePerDay() const noexcept     { return lateFeePerDay_; }
+string id() const noexcept override       { return string(itemId_); }
+string_view idView() const noexcept override { return itemId_; }
+IdHandle idHandle() const noexcept override  { return handle_.get(itemId_); }
+string getTitle() const noexcept          { return string(title_); }
+Money lateFeePerDay() const noexcept      { return lateFeePerDay_; }
 
 // Must be implemented by derived classes:
 virtual string typeName() const noexcept = 0;
-virtual double computeLateFee(int daysLate) const noexcept = 0;
+virtual ItemKind kind() const noexcept = 0;
+virtual Money computeLateFee(int daysLate) const noexcept = 0;
 
 
 protected:
-string itemId_;
-string title_;
-double lateFeePerDay_;
+pmr::string itemId_;
+pmr::string title_;
+Money lateFeePerDay_;
+LazyIdHandle handle_;
 };
 
 // ============================================================================
@@ -180,14 +752,18 @@ double lateFeePerDay_;
 // ============================================================================
 class Book : public LibraryItem {
 public:
-Book(string itemId, string title)
-: LibraryItem(move(itemId), move(title), 1.0) {}
+Book(string_view itemId, string_view title)
+: Book(allocator_arg, allocator_type(), itemId, title) {}
+
+Book(allocator_arg_t, allocator_type alloc, string_view itemId, string_view title)
+: LibraryItem(allocator_arg, alloc, itemId, title, kindFeePerDay(ItemKind::Book)) {}
 
 
 string typeName() const noexcept override { return "Book"; }
+ItemKind kind() const noexcept override    { return ItemKind::Book; }
 
-double computeLateFee(int daysLate) const noexcept override {
-    return daysLate * lateFeePerDay_;
+Money computeLateFee(int daysLate) const noexcept override {
+    return lateFeePerDay_ * daysLate;
 }
 
 
@@ -199,14 +775,18 @@ double computeLateFee(int daysLate) const noexcept override {
 // ============================================================================
 class Magazine : public LibraryItem {
 public:
-Magazine(string itemId, string title)
-: LibraryItem(move(itemId), move(title), 0.5) {}
+Magazine(string_view itemId, string_view title)
+: Magazine(allocator_arg, allocator_type(), itemId, title) {}
+
+Magazine(allocator_arg_t, allocator_type alloc, string_view itemId, string_view title)
+: LibraryItem(allocator_arg, alloc, itemId, title, kindFeePerDay(ItemKind::Magazine)) {}
 
 
 string typeName() const noexcept override { return "Magazine"; }
+ItemKind kind() const noexcept override    { return ItemKind::Magazine; }
 
-double computeLateFee(int daysLate) const noexcept override {
-    return daysLate * lateFeePerDay_;
+Money computeLateFee(int daysLate) const noexcept override {
+    return lateFeePerDay_ * daysLate;
 }
 
 
@@ -218,135 +798,4837 @@ double computeLateFee(int daysLate) const noexcept override {
 // ============================================================================
 class DVD : public LibraryItem {
 public:
-DVD(string itemId, string title)
-: LibraryItem(move(itemId), move(title), 2.0) {}
+DVD(string_view itemId, string_view title)
+: DVD(allocator_arg, allocator_type(), itemId, title) {}
+
+DVD(allocator_arg_t, allocator_type alloc, string_view itemId, string_view title)
+: LibraryItem(allocator_arg, alloc, itemId, title, kindFeePerDay(ItemKind::DVD)) {}
 
 
 string typeName() const noexcept override { return "DVD"; }
+ItemKind kind() const noexcept override    { return ItemKind::DVD; }
 
-double computeLateFee(int daysLate) const noexcept override {
-    return daysLate * lateFeePerDay_;
+Money computeLateFee(int daysLate) const noexcept override {
+    return lateFeePerDay_ * daysLate;
 }
 
 
 };
 
 // ============================================================================
-// Class: BorrowTransaction
-// Represents an instance of a borrower returning an item late.
-// Handles fee calculation, discounts, and balance deduction.
+// Class: LibraryArena
+// Bulk allocator for users and items.
+// create<T>(args...) places a Student/Staff/TeachingAssistant/Book/Magazine/
+// DVD and all of its strings in one monotonic arena, so construction costs
+// a pointer bump instead of several malloc calls. IDs are not interned at
+// construction (see LazyIdHandle); an ID enters the global IdTable, and
+// outlives release(), only once something asks for the object's idHandle().
+// Teardown: objects are NEVER destroyed individually. release() (or the
+// arena destructor) frees the few underlying blocks at once, so returned
+// pointers must not be used afterwards.
 // ============================================================================
-class BorrowTransaction {
+class LibraryArena {
 public:
-BorrowTransaction(Person& borrower, LibraryItem& item, int daysLate = 0)
-: borrower_(&borrower), item_(&item),
-daysLate_(daysLate), isOpen_(true), lateFeeCost_(0.0) {}
+explicit LibraryArena(size_t initialBytes = 64 * 1024) : resource_(initialBytes) {}
 
+LibraryArena(const LibraryArena&) = delete;
+LibraryArena& operator=(const LibraryArena&) = delete;
 
-// Process the late fees:
-// - Compute fee based on item type
-// - Apply student discount (if applicable)
-// - Deduct from user balance
-double process() {
-    if (!isOpen_) return lateFeeCost_;
+template <typename T, typename... Args>
+T* create(Args&&... args) {
+    static_assert(is_base_of_v<Person, T> || is_base_of_v<LibraryItem, T>,
+                  "LibraryArena only creates users and library items");
+    void* memory = resource_.allocate(sizeof(T), alignof(T));
+    return ::new (memory) T(allocator_arg, typename T::allocator_type(&resource_),
+                            forward<Args>(args)...);
+}
 
-    // Base cost calculated from the LibraryItem
-    double cost = item_->computeLateFee(daysLate_);
+// Drop every object created so far in one step
+void release() noexcept { resource_.release(); }
 
-    // If borrower is a Student (or derived type), apply discount
-    if (auto* s = dynamic_cast<Student*>(borrower_))
-        cost *= s->getDiscountFactor();
+pmr::memory_resource* resource() noexcept { return &resource_; }
 
-    // Deduct cost from the user's balance
-    borrower_->deduct(cost);
 
-    // Store the final cost and close the transaction
-    lateFeeCost_ = cost;
-    isOpen_ = false;
-    return lateFeeCost_;
+private:
+pmr::monotonic_buffer_resource resource_;
+};
+
+// ============================================================================
+// Value Type: PackedUser
+// Flat, trivially-copyable form of a user for large tables: no vptrs, no
+// virtual-base offsets and no owned strings, so a vector<PackedUser> can
+// be memcpy'd and scanned linearly. Roles are the PersonRole bits (a
+// TeachingAssistant has both); the ID is an IdTable handle, the name and
+// email handles into a TextPool that the caller keeps next to the records
+// (names and emails are not pinned in any global table). packUser() and
+// makeUser() convert to and from the class hierarchy given that pool; a
+// round trip preserves every field the classes expose.
+// ============================================================================
+struct PackedUser {
+    Money balance;
+    IdHandle id;
+    TextHandle name;
+    TextHandle email;
+    uint32_t borrowLimit = Person::kUnlimitedBorrows;
+    Discount discount;           // fee discount (Students only)
+    uint8_t roles = RoleNone;
+    bool canApprovePurchases = false; // Staff only
+    uint8_t reserved[2] = {};
+
+    bool hasRole(PersonRole role) const noexcept { return (roles & role) != 0; }
+    string_view idView() const   { return IdTable::global().name(id); }
+    string_view nameView(const TextPool& text) const  { return text.name(name); }
+    string_view emailView(const TextPool& text) const { return text.name(email); }
+};
+
+static_assert(is_trivially_copyable_v<PackedUser>, "PackedUser must be memcpy-able");
+static_assert(sizeof(PackedUser) == 32, "PackedUser layout");
+
+// Flatten any user into a record, interning its name and email in `text`
+inline PackedUser packUser(const Person& person, TextPool& text) {
+    PackedUser record;
+    record.balance     = person.getBalance();
+    record.id          = person.idHandle();
+    record.name        = text.intern(person.getName());
+    record.email       = text.intern(person.getEmail());
+    record.borrowLimit = person.borrowLimit();
+    record.discount    = person.feeDiscount();
+    record.roles       = person.roles();
+    record.canApprovePurchases = person.hasPurchaseApproval();
+    return record;
 }
 
-// Accessors:
-string getUserId() const noexcept { return borrower_->id(); }
-string getItemId() const noexcept { return item_->id(); }
-bool isOpened() const noexcept    { return isOpen_; }
-double getLateFeeCost() const noexcept { return lateFeeCost_; }
+// Build the matching class for a record's roles: TeachingAssistant,
+// Student, Staff or plain Person. `make` is called as
+// make(static_cast<T*>(nullptr), args...) for the chosen T. `text` is the
+// pool the record was packed with.
+template <typename Make>
+auto makeUserWith(const PackedUser& record, const TextPool& text, Make&& make) {
+    string_view id = record.idView(), name = record.nameView(text), email = record.emailView(text);
+    double balance = record.balance.toDouble();
+    int limit = record.borrowLimit > uint32_t(INT32_MAX) ? INT32_MAX : int(record.borrowLimit);
+    double discount = record.discount.factor();
 
+    bool student = record.hasRole(RoleStudent), staff = record.hasRole(RoleStaff);
+    if (student && staff)
+        return make(static_cast<TeachingAssistant*>(nullptr), id, name, email, balance, limit,
+                    discount, record.canApprovePurchases);
+    if (student)
+        return make(static_cast<Student*>(nullptr), id, name, email, balance, limit, discount);
+    if (staff)
+        return make(static_cast<Staff*>(nullptr), id, name, email, balance, record.canApprovePurchases);
+    return make(static_cast<Person*>(nullptr), id, name, email, balance);
+}
 
-private:
-Person* borrower_;
-LibraryItem* item_;
-int daysLate_;
-bool isOpen_;
-double lateFeeCost_;
-};
+inline unique_ptr<Person> makeUser(const PackedUser& record, const TextPool& text) {
+    return makeUserWith(record, text, [](auto type, auto&&... args) -> unique_ptr<Person> {
+        using T = remove_pointer_t<decltype(type)>;
+        return make_unique<T>(forward<decltype(args)>(args)...);
+    });
+}
+
+// Same, placed in an arena (see LibraryArena for lifetime rules)
+inline Person* makeUser(LibraryArena& arena, const PackedUser& record, const TextPool& text) {
+    return makeUserWith(record, text, [&arena](auto type, auto&&... args) -> Person* {
+        using T = remove_pointer_t<decltype(type)>;
+        return arena.create<T>(forward<decltype(args)>(args)...);
+    });
+}
 
 // ============================================================================
-// MAIN PROGRAM
-// Demonstrates:
-// - Polymorphic user display
-// - Fund management
-// - Borrowing and fee deduction
+// Class: ItemStore
+// Columnar (struct-of-arrays) catalog storage.
+// Each field lives in its own contiguous column and titles share one
+// character buffer, so full-catalog scans walk memory linearly with no
+// per-item heap node or virtual call. Items are read through ItemRef.
+// Title offsets are 32-bit, so the title buffer is limited to 4 GiB;
+// add() throws length_error rather than let an offset wrap.
 // ============================================================================
-int main() {
+class ItemStore {
+public:
+// Thin read-only view of one stored item (mirrors the LibraryItem API)
+class ItemRef {
+public:
+ItemRef(const ItemStore& store, size_t index) noexcept : store_(&store), index_(index) {}
 
+IdHandle idHandle() const noexcept      { return store_->ids_[index_]; }
+string_view idView() const              { return IdTable::global().name(idHandle()); }
+string_view getTitle() const noexcept   { return store_->title(index_); }
+ItemKind kind() const noexcept          { return store_->kinds_[index_]; }
+string_view typeName() const noexcept   { return kindName(kind()); }
+Money lateFeePerDay() const noexcept    { return store_->feePerDay_[index_]; }
 
-// ------------------------------------------------------------
-// 1. Create Users (stored polymorphically as Person*)
-// ------------------------------------------------------------
-vector<unique_ptr<Person>> users;
-users.emplace_back(make_unique<Student>("S100","Amina","amina@uni.edu",50.0,2,0.8));
-users.emplace_back(make_unique<Staff>("ST200","Omar","omar@uni.edu",75.0,true));
-users.emplace_back(make_unique<TeachingAssistant>("TA300","Lina","lina@uni.edu",60.0,2,0.85,true));
+Money computeLateFee(int daysLate) const noexcept {
+    return lateFeePerDay() * daysLate;
+}
 
-cout << "=== Users ===\n";
-for (const auto& u : users)
-    u->display();
 
-// ------------------------------------------------------------
-// 2. Add funds to users
-// ------------------------------------------------------------
-users[0]->addFunds(20);
-users[1]->addFunds(10);
-users[2]->addFunds(5);
+private:
+const ItemStore* store_;
+size_t index_;
+};
 
-cout << "\n=== Users After Adding Funds ===\n";
-for (const auto& u : users)
-    u->display();
+ItemStore() { titleOffsets_.push_back(0); }
 
-// ------------------------------------------------------------
-// 3. Create Library Items
-// ------------------------------------------------------------
-vector<unique_ptr<LibraryItem>> items;
-items.emplace_back(make_unique<Book>("B001","Effective C++"));
-items.emplace_back(make_unique<Magazine>("M010","Tech Monthly"));
-items.emplace_back(make_unique<DVD>("D100","C++ Patterns"));
+// Pre-size every column for `count` items and `titleBytes` of title text
+void reserve(size_t count, size_t titleBytes = 0) {
+    ids_.reserve(count);
+    kinds_.reserve(count);
+    feePerDay_.reserve(count);
+    titleOffsets_.reserve(count + 1);
+    titles_.reserve(titleBytes);
+}
 
-cout << "\n=== Library Items ===\n";
-for (const auto& it : items)
-    cout << it->id() << " | " << it->getTitle()
-         << " | " << it->typeName()
-         << " | fee/day: " << it->lateFeePerDay() << "\n";
+// Append an item of the given kind; returns its index
+size_t add(ItemKind kind, string_view itemId, string_view title) {
+    if (title.size() > UINT32_MAX - titles_.size())
+        throw length_error("ItemStore: title buffer would exceed 4 GiB");
+    ids_.push_back(IdTable::global().intern(itemId));
+    kinds_.push_back(kind);
+    feePerDay_.push_back(kindFeePerDay(kind));
+    titles_.append(title);
+    titleOffsets_.push_back(static_cast<uint32_t>(titles_.size()));
+    return ids_.size() - 1;
+}
 
-// ------------------------------------------------------------
-// 4. Simulate a Borrow Transaction
-// Student Amina returns a book 5 days late
-// ------------------------------------------------------------
-Person& borrower       = *users[0];
-LibraryItem& borrowed  = *items[0];
+// Copy an existing LibraryItem into the store; returns its index
+size_t add(const LibraryItem& item) {
+    size_t index = add(item.kind(), item.idView(), item.getTitle());
+    feePerDay_[index] = item.lateFeePerDay();
+    return index;
+}
 
-BorrowTransaction tx(borrower, borrowed, 5);
-double finalFee = tx.process();
+size_t size() const noexcept                { return ids_.size(); }
+ItemRef operator[](size_t index) const noexcept { return ItemRef(*this, index); }
 
-// ------------------------------------------------------------
-// 5. Display transaction summary
-// ------------------------------------------------------------
-cout << "\n=== Transaction Summary ===\n";
-cout << "User: " << tx.getUserId() << " | Item: " << tx.getItemId() << "\n";
-cout << "Days late: 5 | Fee charged: " << fixed << setprecision(2) << finalFee << "\n";
-cout << "Remaining balance: " << borrower.getBalance() << "\n";
-cout << "Transaction open: " << (tx.isOpened() ? "Yes" : "No") << "\n";
+// Raw column access for bulk scans
+const IdHandle* idColumn() const noexcept   { return ids_.data(); }
+const ItemKind* kindColumn() const noexcept { return kinds_.data(); }
+const Money* feeColumn() const noexcept     { return feePerDay_.data(); }
 
-return 0;
 
+private:
+string_view title(size_t index) const noexcept {
+    return string_view(titles_).substr(titleOffsets_[index],
+                                       titleOffsets_[index + 1] - titleOffsets_[index]);
 }
+
+vector<IdHandle> ids_;
+vector<ItemKind> kinds_;
+vector<Money> feePerDay_;
+vector<uint32_t> titleOffsets_; // size()+1 entries; title i is [off[i], off[i+1])
+string titles_;
+};
+
+// ============================================================================
+// Traits: ItemTraits<Kind>
+// Compile-time facts about each closed item kind. Code that knows the kind
+// statically (see KindItem) reads these as constants, so fee math inlines
+// to a multiply with no virtual call or table load.
+// ============================================================================
+template <ItemKind Kind>
+struct ItemTraits {
+    static constexpr ItemKind kind = Kind;
+    static constexpr string_view name = kindName(Kind);
+    static constexpr Money feePerDay = kindFeePerDay(Kind);
+};
+
+// ============================================================================
+// Value Type: KindItem / ItemVariant
+// Alternative to the LibraryItem hierarchy for the three closed kinds.
+// A KindItem is a small trivially-copyable record (ID handle plus the
+// location of its title in the owning VariantCatalog), and ItemVariant is a
+// std::variant over the three of them, so items sit inline in a vector
+// with no heap node per item. typeName()/computeLateFee() dispatch through
+// std::visit, which the compiler lowers to a switch over the constexpr
+// traits above.
+// ============================================================================
+template <ItemKind Kind>
+struct KindItem {
+    using Traits = ItemTraits<Kind>;
+
+    IdHandle id;
+    uint32_t titleOffset = 0;
+    uint32_t titleLength = 0;
+
+    static constexpr ItemKind kind() noexcept             { return Kind; }
+    static constexpr string_view typeName() noexcept      { return Traits::name; }
+    static constexpr Money lateFeePerDay() noexcept       { return Traits::feePerDay; }
+    static constexpr Money computeLateFee(int daysLate) noexcept {
+        return Traits::feePerDay * daysLate;
+    }
+};
+
+using BookItem     = KindItem<ItemKind::Book>;
+using MagazineItem = KindItem<ItemKind::Magazine>;
+using DVDItem      = KindItem<ItemKind::DVD>;
+using ItemVariant  = variant<BookItem, MagazineItem, DVDItem>;
+
+static_assert(is_trivially_copyable_v<ItemVariant>, "ItemVariant must stay inline-copyable");
+
+inline ItemKind kindOf(const ItemVariant& item) noexcept {
+    return visit([](const auto& i) { return i.kind(); }, item);
+}
+
+inline string_view typeName(const ItemVariant& item) noexcept {
+    return visit([](const auto& i) { return i.typeName(); }, item);
+}
+
+inline Money computeLateFee(const ItemVariant& item, int daysLate) noexcept {
+    return visit([daysLate](const auto& i) { return i.computeLateFee(daysLate); }, item);
+}
+
+// ============================================================================
+// Class: VariantCatalog
+// Owns a vector<ItemVariant> plus one shared title buffer (as ItemStore
+// does), so adding an item never allocates a node of its own. Titles are
+// referenced by 32-bit offset and length, so the buffer is limited to
+// 4 GiB; add() throws length_error past that.
+// ============================================================================
+class VariantCatalog {
+public:
+void reserve(size_t count, size_t titleBytes = 0) {
+    items_.reserve(count);
+    titles_.reserve(titleBytes);
+}
+
+// Append an item of the given kind; returns its index
+size_t add(ItemKind kind, string_view itemId, string_view title) {
+    if (title.size() > UINT32_MAX - titles_.size())
+        throw length_error("VariantCatalog: title buffer would exceed 4 GiB");
+    IdHandle id = IdTable::global().intern(itemId);
+    uint32_t offset = static_cast<uint32_t>(titles_.size());
+    uint32_t length = static_cast<uint32_t>(title.size());
+    titles_.append(title);
+    switch (kind) {
+    case ItemKind::Book:     items_.emplace_back(BookItem{id, offset, length}); break;
+    case ItemKind::Magazine: items_.emplace_back(MagazineItem{id, offset, length}); break;
+    case ItemKind::DVD:      items_.emplace_back(DVDItem{id, offset, length}); break;
+    }
+    return items_.size() - 1;
+}
+
+// Copy an existing LibraryItem; its fee must be the standard one for its kind
+size_t add(const LibraryItem& item) {
+    if (item.lateFeePerDay() != kindFeePerDay(item.kind()))
+        throw invalid_argument("VariantCatalog: non-standard fee for item " + item.id());
+    return add(item.kind(), item.idView(), item.getTitle());
+}
+
+size_t size() const noexcept                             { return items_.size(); }
+const ItemVariant& operator[](size_t index) const noexcept { return items_[index]; }
+const ItemVariant* data() const noexcept                 { return items_.data(); }
+
+string_view idView(size_t index) const {
+    return IdTable::global().name(visit([](const auto& i) { return i.id; }, items_[index]));
+}
+
+string_view getTitle(size_t index) const noexcept {
+    return visit([this](const auto& i) {
+        return string_view(titles_).substr(i.titleOffset, i.titleLength);
+    }, items_[index]);
+}
+
+// out[i] = fee for items[i] returned daysLate[i] days late
+void computeLateFees(const int* daysLate, Money* out) const noexcept {
+    for (size_t i = 0; i < items_.size(); ++i)
+        out[i] = computeLateFee(items_[i], daysLate[i]);
+}
+
+
+private:
+vector<ItemVariant> items_;
+string titles_;
+};
+
+// ============================================================================
+// Batch Kernel: computeLateFees
+// Computes many late fees in one call without a virtual call per item:
+//     out[i] = discounts[i].apply(kindFeePerDay(kinds[i]) * daysLate[i])
+// This is exactly LibraryItem::computeLateFee followed by the Student
+// discount (use Discount() for borrowers without one), so results are
+// identical to the one-at-a-time path. The widest supported SIMD path is
+// picked once at runtime: AVX-512, AVX2, SSE4.2 or scalar.
+// The SIMD paths evaluate the integer cent formula in double lanes; every
+// intermediate is an integer below 2^53, so no rounding ever occurs.
+// Precondition: every kinds[i] is a valid ItemKind.
+// ============================================================================
+namespace feekernel {
+
+static_assert(sizeof(Money) == sizeof(int64_t), "Money must be a bare int64 of cents");
+static_assert(sizeof(Discount) == sizeof(uint32_t), "Discount must be a bare uint32 of basis points");
+
+constexpr double kFeeCents[] = {
+    double(kindFeePerDay(ItemKind::Book).cents()),
+    double(kindFeePerDay(ItemKind::Magazine).cents()),
+    double(kindFeePerDay(ItemKind::DVD).cents()),
+};
+constexpr double kScale = Discount::kScale;
+constexpr double kHalf  = Discount::kScale / 2;
+constexpr double kMagic = 6755399441055744.0; // 1.5 * 2^52: integral double <-> int64 bit trick
+
+using KernelFn = void (*)(const ItemKind*, const int*, const Discount*, Money*, size_t);
+
+inline void scalar(const ItemKind* kinds, const int* daysLate,
+                   const Discount* discounts, Money* out, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        out[i] = discounts[i].apply(kindFeePerDay(kinds[i]) * daysLate[i]);
+}
+
+#ifdef LIBRARY_X86_DISPATCH
+// GCC's gather/convert intrinsics trip a false -Wmaybe-uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("sse4.2")))
+inline void sse42(const ItemKind* kinds, const int* daysLate,
+                  const Discount* discounts, Money* out, size_t count) {
+    const __m128d sign  = _mm_set1_pd(-0.0);
+    const __m128d half  = _mm_set1_pd(kHalf);
+    const __m128d scale = _mm_set1_pd(kScale);
+    const __m128d magic = _mm_set1_pd(kMagic);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d fee  = _mm_set_pd(kFeeCents[static_cast<size_t>(kinds[i + 1])],
+                                  kFeeCents[static_cast<size_t>(kinds[i])]);
+        __m128d days = _mm_cvtepi32_pd(_mm_loadl_epi64(
+                           reinterpret_cast<const __m128i*>(daysLate + i)));
+        __m128d bp   = _mm_cvtepi32_pd(_mm_loadl_epi64(
+                           reinterpret_cast<const __m128i*>(discounts + i)));
+        __m128d base = _mm_mul_pd(days, fee);
+        __m128d mag  = _mm_andnot_pd(sign, base);
+        __m128d q    = _mm_floor_pd(_mm_div_pd(_mm_add_pd(_mm_mul_pd(mag, bp), half), scale));
+        q = _mm_or_pd(q, _mm_and_pd(sign, base));
+        __m128i cents = _mm_sub_epi64(_mm_castpd_si128(_mm_add_pd(q, magic)),
+                                      _mm_castpd_si128(magic));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), cents);
+    }
+    scalar(kinds + i, daysLate + i, discounts + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+inline void avx2(const ItemKind* kinds, const int* daysLate,
+                 const Discount* discounts, Money* out, size_t count) {
+    const __m256d sign  = _mm256_set1_pd(-0.0);
+    const __m256d half  = _mm256_set1_pd(kHalf);
+    const __m256d scale = _mm256_set1_pd(kScale);
+    const __m256d magic = _mm256_set1_pd(kMagic);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int32_t packed;
+        memcpy(&packed, kinds + i, sizeof(packed));
+        __m128i index = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+        __m256d fee   = _mm256_i32gather_pd(kFeeCents, index, 8);
+        __m256d days  = _mm256_cvtepi32_pd(_mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(daysLate + i)));
+        __m256d bp    = _mm256_cvtepi32_pd(_mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(discounts + i)));
+        __m256d base  = _mm256_mul_pd(days, fee);
+        __m256d mag   = _mm256_andnot_pd(sign, base);
+        __m256d q     = _mm256_floor_pd(_mm256_div_pd(
+                            _mm256_add_pd(_mm256_mul_pd(mag, bp), half), scale));
+        q = _mm256_or_pd(q, _mm256_and_pd(sign, base));
+        __m256i cents = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(q, magic)),
+                                         _mm256_castpd_si256(magic));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), cents);
+    }
+    scalar(kinds + i, daysLate + i, discounts + i, out + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+inline void avx512(const ItemKind* kinds, const int* daysLate,
+                   const Discount* discounts, Money* out, size_t count) {
+    const __m512i sign  = _mm512_castpd_si512(_mm512_set1_pd(-0.0));
+    const __m512d half  = _mm512_set1_pd(kHalf);
+    const __m512d scale = _mm512_set1_pd(kScale);
+    const __m512d magic = _mm512_set1_pd(kMagic);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                            reinterpret_cast<const __m128i*>(kinds + i)));
+        __m512d fee   = _mm512_i32gather_pd(index, kFeeCents, 8);
+        __m512d days  = _mm512_cvtepi32_pd(_mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(daysLate + i)));
+        __m512d bp    = _mm512_cvtepi32_pd(_mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(discounts + i)));
+        __m512i base  = _mm512_castpd_si512(_mm512_mul_pd(days, fee));
+        __m512d mag   = _mm512_castsi512_pd(_mm512_andnot_si512(sign, base));
+        __m512d q     = _mm512_floor_pd(_mm512_div_pd(
+                            _mm512_add_pd(_mm512_mul_pd(mag, bp), half), scale));
+        q = _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(q),
+                                                _mm512_and_si512(sign, base)));
+        __m512i cents = _mm512_sub_epi64(_mm512_castpd_si512(_mm512_add_pd(q, magic)),
+                                         _mm512_castpd_si512(magic));
+        _mm512_storeu_si512(out + i, cents);
+    }
+    scalar(kinds + i, daysLate + i, discounts + i, out + i, count - i);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+struct Dispatch {
+    KernelFn fn;
+    const char* name;
+};
+
+inline Dispatch select() noexcept {
+#ifdef LIBRARY_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return {avx512, "avx512"};
+    if (__builtin_cpu_supports("avx2"))    return {avx2, "avx2"};
+    if (__builtin_cpu_supports("sse4.2"))  return {sse42, "sse4.2"};
+#endif
+    return {scalar, "scalar"};
+}
+
+inline const Dispatch& active() noexcept {
+    static const Dispatch dispatch = select();
+    return dispatch;
+}
+
+} // namespace feekernel
+
+inline void computeLateFees(const ItemKind* kinds, const int* daysLate,
+                            const Discount* discounts, Money* out, size_t count) {
+    feekernel::active().fn(kinds, daysLate, discounts, out, count);
+}
+
+// Name of the kernel chosen for this CPU ("avx512", "avx2", "sse4.2" or "scalar")
+inline const char* lateFeeKernelName() noexcept {
+    return feekernel::active().name;
+}
+
+class TransactionBatch;
+
+// Library calendar day number (day 0 is whenever the desk started counting)
+using LibraryDay = int32_t;
+
+// ============================================================================
+// Class: BorrowTransaction
+// Represents an instance of a borrower returning an item late.
+// Handles fee calculation, discounts, and balance deduction.
+// ============================================================================
+class BorrowTransaction {
+public:
+BorrowTransaction(Person& borrower, LibraryItem& item, int daysLate = 0)
+: borrower_(&borrower), item_(&item),
+daysLate_(daysLate), isOpen_(true), lateFeeCost_() {}
+
+// Days late derived from the loan's due day and the day it came back
+BorrowTransaction(Person& borrower, LibraryItem& item, LibraryDay dueDay, LibraryDay returnDay)
+: BorrowTransaction(borrower, item, returnDay > dueDay ? returnDay - dueDay : 0) {}
+
+
+// Process the late fees:
+// - Compute fee based on item type
+// - Apply student discount (if applicable)
+// - Deduct from user balance
+Money process() {
+    if (!isOpen_) return lateFeeCost_;
+
+    // Base cost calculated from the LibraryItem
+    Money cost = item_->computeLateFee(daysLate_);
+
+    // If borrower is a Student (or derived type), apply discount
+    // (role and discount are cached on Person, so no dynamic_cast is needed)
+    if (borrower_->hasRole(RoleStudent))
+        cost = borrower_->feeDiscount().apply(cost);
+
+    // Deduct cost from the user's balance
+    borrower_->deduct(cost);
+
+    // Store the final cost and close the transaction
+    lateFeeCost_ = cost;
+    isOpen_ = false;
+    return lateFeeCost_;
+}
+
+// Accessors:
+string_view getUserId() const noexcept { return borrower_->idView(); }
+string_view getItemId() const noexcept { return item_->idView(); }
+IdHandle getUserHandle() const noexcept { return borrower_->idHandle(); }
+IdHandle getItemHandle() const noexcept { return item_->idHandle(); }
+int getDaysLate() const noexcept  { return daysLate_; }
+const Person& getBorrower() const noexcept    { return *borrower_; }
+const LibraryItem& getItem() const noexcept   { return *item_; }
+bool isOpened() const noexcept    { return isOpen_; }
+Money getLateFeeCost() const noexcept { return lateFeeCost_; }
+
+
+private:
+friend class TransactionBatch;
+
+Person* borrower_;
+LibraryItem* item_;
+int daysLate_;
+bool isOpen_;
+Money lateFeeCost_;
+};
+
+// ============================================================================
+// Class: TransactionBatch
+// Processes many BorrowTransactions in one call:
+// - Fees for all open transactions are computed by the batch kernel
+// - Transactions are grouped by borrower
+// - Each borrower gets ONE deduction of their summed fees
+// - Every transaction is closed with its own lateFeeCost_
+// Money sums are exact and, while every fee is >= 0, one clamped deduction
+// of the sum leaves the same balance as calling Person::deduct once per
+// transaction in order. A negative daysLate yields a negative fee (a
+// credit), where the clamp makes order matter, so a borrower with any
+// negative fee in the batch is charged one transaction at a time instead.
+// Scratch buffers are reused between calls.
+// ============================================================================
+class TransactionBatch {
+public:
+// Process every open transaction in [txs, txs + count); returns total charged
+Money processAll(BorrowTransaction* txs, size_t count) {
+    open_.clear();
+    for (size_t i = 0; i < count; ++i)
+        if (txs[i].isOpen_) open_.push_back(i);
+    if (open_.empty()) return Money();
+
+    // Gather kernel inputs and compute every fee at once
+    size_t n = open_.size();
+    kinds_.resize(n);
+    days_.resize(n);
+    discounts_.resize(n);
+    fees_.resize(n);
+    for (size_t j = 0; j < n; ++j) {
+        const BorrowTransaction& tx = txs[open_[j]];
+        kinds_[j]     = tx.item_->kind();
+        days_[j]      = tx.daysLate_;
+        discounts_[j] = tx.borrower_->hasRole(RoleStudent) ? tx.borrower_->feeDiscount() : Discount();
+    }
+    computeLateFees(kinds_.data(), days_.data(), discounts_.data(), fees_.data(), n);
+
+    // Group by borrower, keeping submission order inside each group
+    order_.resize(n);
+    for (size_t j = 0; j < n; ++j) order_[j] = j;
+    stable_sort(order_.begin(), order_.end(), [&](size_t a, size_t b) {
+        return txs[open_[a]].borrower_ < txs[open_[b]].borrower_;
+    });
+
+    // One aggregated deduction per borrower, then close each transaction
+    Money charged;
+    for (size_t run = 0; run < n;) {
+        Person* borrower = txs[open_[order_[run]]].borrower_;
+        Money total;
+        bool hasCredit = false;
+        size_t end = run;
+        for (; end < n && txs[open_[order_[end]]].borrower_ == borrower; ++end) {
+            BorrowTransaction& tx = txs[open_[order_[end]]];
+            tx.lateFeeCost_ = fees_[order_[end]];
+            tx.isOpen_ = false;
+            total += tx.lateFeeCost_;
+            hasCredit |= tx.lateFeeCost_ < Money();
+        }
+        if (hasCredit) {
+            for (size_t k = run; k < end; ++k) borrower->deduct(fees_[order_[k]]);
+        } else {
+            borrower->deduct(total);
+        }
+        charged += total;
+        run = end;
+    }
+    return charged;
+}
+
+Money processAll(vector<BorrowTransaction>& txs) {
+    return processAll(txs.data(), txs.size());
+}
+
+
+private:
+vector<size_t> open_;   // indices of open transactions in the input
+vector<size_t> order_;  // positions into open_, grouped by borrower
+vector<ItemKind> kinds_;
+vector<int> days_;
+vector<Discount> discounts_;
+vector<Money> fees_;
+};
+
+// ============================================================================
+// Class: BalanceLedger
+// Thread-safe balances for users shared between fee and payment workers.
+// Each account is an atomic count of cents on its own cache line, so
+// threads updating different users never contend. Operations mirror
+// Person::addFunds / Person::deduct, including "never below zero".
+// Capacity is fixed at construction; accounts are never removed.
+// ============================================================================
+class BalanceLedger {
+public:
+explicit BalanceLedger(size_t capacity)
+: slots_(make_unique<Slot[]>(capacity)), capacity_(capacity) {}
+
+// Open an account with an initial balance; returns its account number
+size_t open(Money initial) {
+    size_t account = next_.fetch_add(1, memory_order_relaxed);
+    if (account >= capacity_) throw length_error("BalanceLedger: capacity exceeded");
+    slots_[account].cents.store(initial.cents(), memory_order_relaxed);
+    return account;
+}
+size_t open(const Person& person) { return open(person.getBalance()); }
+
+Money balance(size_t account) const noexcept {
+    return Money::fromCents(slots_[account].cents.load(memory_order_acquire));
+}
+
+// Add funds (non-positive amounts are ignored, like Person::addFunds)
+void deposit(size_t account, Money amount) noexcept {
+    if (amount > Money())
+        slots_[account].cents.fetch_add(amount.cents(), memory_order_acq_rel);
+}
+
+// Deduct up to `amount`, never leaving a negative balance.
+// Returns the amount actually collected.
+Money deduct(size_t account, Money amount) noexcept {
+    atomic<int64_t>& cents = slots_[account].cents;
+    int64_t current = cents.load(memory_order_relaxed);
+    int64_t next;
+    do {
+        next = current - amount.cents();
+        if (next < 0) next = 0;
+    } while (!cents.compare_exchange_weak(current, next,
+                                          memory_order_acq_rel, memory_order_relaxed));
+    return Money::fromCents(current - next);
+}
+
+size_t size() const noexcept     { return min(next_.load(memory_order_relaxed), capacity_); }
+size_t capacity() const noexcept { return capacity_; }
+
+
+private:
+struct alignas(64) Slot {
+    atomic<int64_t> cents{0};
+};
+
+unique_ptr<Slot[]> slots_;
+size_t capacity_;
+atomic<size_t> next_{0};
+};
+
+// ============================================================================
+// Class Template: IdIndex
+// Open-addressing hash index from an ID string to a T* (T must provide
+// idView()). Linear probing over a power-of-two table kept at most half
+// full; each slot caches the full hash so probes rarely touch the object.
+// Lookups take a string_view, so callers never build a std::string.
+// ============================================================================
+template <typename T>
+class IdIndex {
+public:
+// Find the entry whose ID equals `id` (nullptr if absent)
+T* find(string_view id) const noexcept {
+    if (slots_.empty()) return nullptr;
+    size_t hash = hasher(id);
+    for (size_t i = hash & mask();; i = (i + 1) & mask()) {
+        const Slot& slot = slots_[i];
+        if (!slot.value) return nullptr;
+        if (slot.hash == hash && slot.value->idView() == id) return slot.value;
+    }
+}
+
+// Insert `value` under its own ID; returns false if the ID is already indexed
+bool insert(T& value) {
+    if ((size_ + 1) * 2 > slots_.size()) rehash(slots_.empty() ? 16 : slots_.size() * 2);
+    string_view id = value.idView();
+    size_t hash = hasher(id);
+    for (size_t i = hash & mask();; i = (i + 1) & mask()) {
+        Slot& slot = slots_[i];
+        if (!slot.value) {
+            slot = Slot{hash, &value};
+            ++size_;
+            return true;
+        }
+        if (slot.hash == hash && slot.value->idView() == id) return false;
+    }
+}
+
+void reserve(size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    if (capacity > slots_.size()) rehash(capacity);
+}
+
+size_t size() const noexcept { return size_; }
+
+
+private:
+struct Slot {
+    size_t hash = 0;
+    T* value = nullptr; // nullptr marks an empty slot
+};
+
+static size_t hasher(string_view id) noexcept { return hash<string_view>()(id); }
+size_t mask() const noexcept { return slots_.size() - 1; }
+
+void rehash(size_t capacity) {
+    vector<Slot> old(capacity);
+    old.swap(slots_);
+    for (const Slot& slot : old) {
+        if (!slot.value) continue;
+        size_t i = slot.hash & mask();
+        while (slots_[i].value) i = (i + 1) & mask();
+        slots_[i] = slot;
+    }
+}
+
+vector<Slot> slots_;
+size_t size_ = 0;
+};
+
+// ============================================================================
+// Class: UserDirectory
+// All library users in insertion order, with O(1) expected lookup by ID.
+// add() takes ownership; link() indexes a user owned elsewhere (e.g. by a
+// LibraryArena), which must outlive the directory.
+// ============================================================================
+class UserDirectory {
+public:
+Person& add(unique_ptr<Person> person) {
+    Person& added = link(*person);
+    owned_.push_back(move(person));
+    return added;
+}
+
+Person& link(Person& person) {
+    if (!index_.insert(person)) throw invalid_argument("duplicate user ID");
+    users_.push_back(&person);
+    return person;
+}
+
+Person* find(string_view id) const noexcept { return index_.find(id); }
+
+void reserve(size_t count) {
+    users_.reserve(count);
+    index_.reserve(count);
+}
+
+size_t size() const noexcept                   { return users_.size(); }
+Person& operator[](size_t index) const noexcept { return *users_[index]; }
+auto begin() const noexcept                    { return users_.begin(); }
+auto end() const noexcept                      { return users_.end(); }
+
+
+private:
+vector<Person*> users_;
+vector<unique_ptr<Person>> owned_;
+IdIndex<Person> index_;
+};
+
+// ============================================================================
+// Class: Catalog
+// All library items in insertion order, with O(1) expected lookup by ID.
+// Ownership rules match UserDirectory.
+// ============================================================================
+class Catalog {
+public:
+LibraryItem& add(unique_ptr<LibraryItem> item) {
+    LibraryItem& added = link(*item);
+    owned_.push_back(move(item));
+    return added;
+}
+
+LibraryItem& link(LibraryItem& item) {
+    if (!index_.insert(item)) throw invalid_argument("duplicate item ID");
+    items_.push_back(&item);
+    return item;
+}
+
+LibraryItem* find(string_view id) const noexcept { return index_.find(id); }
+
+void reserve(size_t count) {
+    items_.reserve(count);
+    index_.reserve(count);
+}
+
+size_t size() const noexcept                        { return items_.size(); }
+LibraryItem& operator[](size_t index) const noexcept { return *items_[index]; }
+auto begin() const noexcept                         { return items_.begin(); }
+auto end() const noexcept                           { return items_.end(); }
+
+
+private:
+vector<LibraryItem*> items_;
+vector<unique_ptr<LibraryItem>> owned_;
+IdIndex<LibraryItem> index_;
+};
+
+// ============================================================================
+// Snapshot File Format (version 3, native byte order)
+//   SnapshotHeader
+//   SnapshotUser[userCount]   at usersOffset  (8-byte aligned)
+//   SnapshotItem[itemCount]   at itemsOffset  (8-byte aligned)
+//   string bytes              at stringsOffset (referenced by offset+length)
+// Records are fixed-size PODs, so a mapped file is read in place.
+// String offsets are 32-bit, so the string area is limited to 4 GiB;
+// writeSnapshot() throws rather than write a file past that limit.
+// logLsn is the last TransactionLog record already reflected in the
+// balances; LogReplayer::replay() skips records up to it.
+// ============================================================================
+namespace snapshot {
+
+constexpr char kMagic[8] = {'L', 'I', 'B', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t kVersion = 3; // 2: borrowLimit for every user, 3: logLsn
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t userCount;
+    uint64_t itemCount;
+    uint64_t usersOffset;
+    uint64_t itemsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t logLsn;
+};
+
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct UserRecord {
+    int64_t balanceCents;
+    StringRef id;
+    StringRef name;
+    StringRef email;
+    uint32_t borrowLimit;  // Person::borrowLimit() (kUnlimitedBorrows unless a Student)
+    uint32_t discountBp;   // Discount basis points (10000 = none)
+    uint8_t roles;         // PersonRole bits
+    uint8_t canApprovePurchases;
+    uint8_t reserved[6];
+};
+
+struct ItemRecord {
+    int64_t feePerDayCents;
+    StringRef id;
+    StringRef title;
+    uint8_t kind;          // ItemKind
+    uint8_t reserved[7];
+};
+
+static_assert(sizeof(Header) == 72, "snapshot header layout");
+static_assert(sizeof(UserRecord) == 48, "snapshot user layout");
+static_assert(sizeof(ItemRecord) == 32, "snapshot item layout");
+
+inline size_t alignUp(size_t value) { return (value + 7) & ~size_t(7); }
+
+} // namespace snapshot
+
+// ============================================================================
+// Function: writeSnapshot
+// Writes every user and item to `path` in the snapshot format.
+// The file is written under a temporary name and renamed into place, so
+// readers never see a partial snapshot. Throws runtime_error on I/O failure.
+// Pass the LSN of the last logged event the balances include (e.g.
+// TransactionLog::durableLsn() taken while no deductions are in flight).
+// ============================================================================
+inline void writeSnapshot(const string& path, const UserDirectory& users, const Catalog& items,
+                          uint64_t logLsn = 0) {
+    using namespace snapshot;
+
+    string strings;
+    auto addString = [&](string_view text) {
+        if (text.size() > UINT32_MAX - strings.size())
+            throw length_error("snapshot string area would exceed 4 GiB: " + path);
+        StringRef ref{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(text.size())};
+        strings.append(text);
+        return ref;
+    };
+
+    vector<UserRecord> userRecords;
+    userRecords.reserve(users.size());
+    for (Person* person : users) {
+        UserRecord record{};
+        record.balanceCents = person->getBalance().cents();
+        record.id    = addString(person->idView());
+        record.name  = addString(person->getName());
+        record.email = addString(person->getEmail());
+        record.roles = person->roles();
+        record.discountBp = person->feeDiscount().basisPoints();
+        record.borrowLimit = person->borrowLimit();
+        record.canApprovePurchases = person->hasPurchaseApproval();
+        userRecords.push_back(record);
+    }
+
+    vector<ItemRecord> itemRecords;
+    itemRecords.reserve(items.size());
+    for (LibraryItem* item : items) {
+        ItemRecord record{};
+        record.feePerDayCents = item->lateFeePerDay().cents();
+        record.id    = addString(item->idView());
+        record.title = addString(item->getTitle());
+        record.kind  = static_cast<uint8_t>(item->kind());
+        itemRecords.push_back(record);
+    }
+
+    Header header{};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version       = kVersion;
+    header.headerSize    = sizeof(Header);
+    header.userCount     = userRecords.size();
+    header.itemCount     = itemRecords.size();
+    header.usersOffset   = alignUp(sizeof(Header));
+    header.itemsOffset   = alignUp(header.usersOffset + userRecords.size() * sizeof(UserRecord));
+    header.stringsOffset = alignUp(header.itemsOffset + itemRecords.size() * sizeof(ItemRecord));
+    header.stringsSize   = strings.size();
+    header.logLsn        = logLsn;
+
+    string tmpPath = path + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file) throw runtime_error("cannot create snapshot " + tmpPath + ": " + strerror(errno));
+
+    bool ok = true;
+    auto put = [&](const void* data, size_t size, uint64_t offset) {
+        if (!ok) return;
+        ok = fseek(file, static_cast<long>(offset), SEEK_SET) == 0 &&
+             (size == 0 || fwrite(data, size, 1, file) == 1);
+    };
+    put(&header, sizeof(header), 0);
+    put(userRecords.data(), userRecords.size() * sizeof(UserRecord), header.usersOffset);
+    put(itemRecords.data(), itemRecords.size() * sizeof(ItemRecord), header.itemsOffset);
+    put(strings.data(), strings.size(), header.stringsOffset);
+    ok = (fflush(file) == 0) && ok;
+    ok = (fsync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        int error = errno;
+        remove(tmpPath.c_str());
+        throw runtime_error("cannot write snapshot " + path + ": " + strerror(error));
+    }
+}
+
+// ============================================================================
+// Class: Snapshot
+// Read-only view of a snapshot file, memory-mapped and served in place.
+// Opening validates the header and table bounds only, so it costs the same
+// for 10 records or 10M; records and strings are paged in on first access.
+// Throws runtime_error if the file is missing, truncated or not a snapshot.
+// ============================================================================
+class Snapshot {
+public:
+// One user record; strings are views into the mapping
+class UserView {
+public:
+UserView(const snapshot::UserRecord& record, const Snapshot& owner) noexcept
+: record_(&record), owner_(&owner) {}
+
+string_view id() const noexcept        { return owner_->text(record_->id); }
+string_view name() const noexcept      { return owner_->text(record_->name); }
+string_view email() const noexcept     { return owner_->text(record_->email); }
+uint8_t roles() const noexcept         { return record_->roles; }
+bool hasRole(PersonRole role) const noexcept { return (record_->roles & role) != 0; }
+Discount discount() const noexcept     { return Discount::fromBasisPoints(record_->discountBp); }
+uint32_t borrowLimit() const noexcept  { return record_->borrowLimit; }
+bool canApprovePurchases() const noexcept { return record_->canApprovePurchases != 0; }
+Money balance() const noexcept         { return Money::fromCents(record_->balanceCents); }
+
+
+private:
+const snapshot::UserRecord* record_;
+const Snapshot* owner_;
+};
+
+// One item record; strings are views into the mapping
+class ItemView {
+public:
+ItemView(const snapshot::ItemRecord& record, const Snapshot& owner) noexcept
+: record_(&record), owner_(&owner) {}
+
+string_view id() const noexcept       { return owner_->text(record_->id); }
+string_view getTitle() const noexcept { return owner_->text(record_->title); }
+ItemKind kind() const noexcept        { return static_cast<ItemKind>(record_->kind); }
+string_view typeName() const noexcept { return kindName(kind()); }
+Money lateFeePerDay() const noexcept  { return Money::fromCents(record_->feePerDayCents); }
+
+
+private:
+const snapshot::ItemRecord* record_;
+const Snapshot* owner_;
+};
+
+explicit Snapshot(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("cannot open snapshot " + path + ": " + strerror(errno));
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(snapshot::Header)) {
+        ::close(fd);
+        throw runtime_error("snapshot too small: " + path);
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) throw runtime_error("cannot map snapshot " + path + ": " + strerror(errno));
+    base_ = static_cast<const char*>(mapping);
+
+    if (!validate()) {
+        munmap(const_cast<char*>(base_), size_);
+        throw runtime_error("not a valid version " + to_string(snapshot::kVersion) + " snapshot: " + path);
+    }
+}
+
+Snapshot(Snapshot&& other) noexcept
+: base_(exchange(other.base_, nullptr)), size_(exchange(other.size_, 0)) {}
+
+Snapshot(const Snapshot&) = delete;
+Snapshot& operator=(const Snapshot&) = delete;
+Snapshot& operator=(Snapshot&&) = delete;
+
+~Snapshot() {
+    if (base_) munmap(const_cast<char*>(base_), size_);
+}
+
+size_t userCount() const noexcept { return header().userCount; }
+size_t itemCount() const noexcept { return header().itemCount; }
+uint64_t logLsn() const noexcept  { return header().logLsn; }
+
+UserView user(size_t index) const noexcept { return UserView(users()[index], *this); }
+ItemView item(size_t index) const noexcept { return ItemView(items()[index], *this); }
+
+
+private:
+const snapshot::Header& header() const noexcept {
+    return *reinterpret_cast<const snapshot::Header*>(base_);
+}
+const snapshot::UserRecord* users() const noexcept {
+    return reinterpret_cast<const snapshot::UserRecord*>(base_ + header().usersOffset);
+}
+const snapshot::ItemRecord* items() const noexcept {
+    return reinterpret_cast<const snapshot::ItemRecord*>(base_ + header().itemsOffset);
+}
+
+// Strings that point outside the string area read as empty
+string_view text(snapshot::StringRef ref) const noexcept {
+    const snapshot::Header& h = header();
+    if (uint64_t(ref.offset) + ref.length > h.stringsSize) return string_view();
+    return string_view(base_ + h.stringsOffset + ref.offset, ref.length);
+}
+
+bool validate() const noexcept {
+    const snapshot::Header& h = header();
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t width) {
+        return offset % 8 == 0 && offset <= size_ &&
+               count <= (size_ - offset) / width;
+    };
+    return memcmp(h.magic, snapshot::kMagic, sizeof(snapshot::kMagic)) == 0 &&
+           h.version == snapshot::kVersion &&
+           h.headerSize == sizeof(snapshot::Header) &&
+           fits(h.usersOffset, h.userCount, sizeof(snapshot::UserRecord)) &&
+           fits(h.itemsOffset, h.itemCount, sizeof(snapshot::ItemRecord)) &&
+           h.stringsOffset <= size_ && h.stringsSize <= size_ - h.stringsOffset;
+}
+
+const char* base_ = nullptr;
+size_t size_ = 0;
+};
+
+// ============================================================================
+// Function: readWholeFile
+// Reads a file into memory (throws runtime_error if it cannot be opened).
+// ============================================================================
+inline string readWholeFile(const string& path) {
+    ifstream in(path, ios::binary);
+    if (!in) throw runtime_error("cannot open " + path);
+    ostringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+// ============================================================================
+// Class: BulkImporter
+// Loads users and items from CSV text using every core.
+//   users: id,name,email,role,balance,maxConcurrentBorrows,discountFactor,canApprovePurchases
+//          role is Student, Staff or TeachingAssistant
+//   items: id,title,type      type is Book, Magazine or DVD
+// The input is split into one chunk per thread at newline boundaries and
+// each chunk is parsed on its own thread straight into its own
+// LibraryArena, sized up front from the chunk length. Results keep file
+// order. Rows that fail validation are skipped and reported with their
+// 1-based line number. A user row is rejected unless its balance is a
+// finite amount within Money range, its discountFactor is in [0, 1] and
+// its maxConcurrentBorrows is not negative. An optional header row
+// starting with "id," is skipped. Fields may be double-quoted ("" escapes
+// a quote) but must not contain newlines.
+// ============================================================================
+class BulkImporter {
+public:
+struct Rejected {
+    size_t line;
+    string reason;
+};
+
+// Imported records; pointers stay valid while this object is alive
+template <typename T>
+struct Result {
+    vector<T*> records;
+    vector<Rejected> rejected;
+    vector<unique_ptr<LibraryArena>> arenas;
+};
+
+static Result<Person> importUsers(string_view csv, unsigned threads = 0) {
+    return importChunks<Person>(csv, threads, parseUser);
+}
+
+static Result<LibraryItem> importItems(string_view csv, unsigned threads = 0) {
+    return importChunks<LibraryItem>(csv, threads, parseItem);
+}
+
+// Read a whole file (throws runtime_error if it cannot be opened)
+static string readFile(const string& path) { return readWholeFile(path); }
+
+
+private:
+static constexpr size_t kMaxFields = 8;
+
+struct Row {
+    string_view fields[kMaxFields];
+    size_t count = 0;
+};
+
+template <typename T>
+struct Chunk {
+    string_view text;
+    size_t lines = 0;
+    vector<T*> records;
+    vector<Rejected> rejected; // line numbers local to the chunk
+    unique_ptr<LibraryArena> arena;
+};
+
+// Returns an error message, or an empty string when the row was accepted
+template <typename T>
+using RowParser = string (*)(const Row&, LibraryArena&, vector<T*>&);
+
+template <typename T>
+static Result<T> importChunks(string_view csv, unsigned threads, RowParser<T> parse) {
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+
+    // Split at newline boundaries into roughly equal chunks
+    vector<Chunk<T>> chunks;
+    size_t target = csv.size() / threads + 1;
+    for (size_t begin = 0; begin < csv.size();) {
+        size_t end = min(csv.size(), begin + target);
+        end = csv.find('\n', end);
+        end = (end == string_view::npos) ? csv.size() : end + 1;
+        chunks.emplace_back();
+        chunks.back().text = csv.substr(begin, end - begin);
+        begin = end;
+    }
+
+    vector<thread> workers;
+    for (size_t c = 1; c < chunks.size(); ++c)
+        workers.emplace_back(parseChunk<T>, ref(chunks[c]), parse, false);
+    if (!chunks.empty()) parseChunk<T>(chunks[0], parse, true);
+    for (thread& worker : workers) worker.join();
+
+    // Stitch results together in file order
+    Result<T> result;
+    size_t total = 0;
+    for (const Chunk<T>& chunk : chunks) total += chunk.records.size();
+    result.records.reserve(total);
+    size_t firstLine = 0;
+    for (Chunk<T>& chunk : chunks) {
+        result.records.insert(result.records.end(), chunk.records.begin(), chunk.records.end());
+        for (Rejected& rejected : chunk.rejected)
+            result.rejected.push_back({firstLine + rejected.line, move(rejected.reason)});
+        result.arenas.push_back(move(chunk.arena));
+        firstLine += chunk.lines;
+    }
+    return result;
+}
+
+template <typename T>
+static void parseChunk(Chunk<T>& chunk, RowParser<T> parse, bool mayHaveHeader) {
+    string_view text = chunk.text;
+    size_t estimatedRows = count(text.begin(), text.end(), '\n') + 1;
+    chunk.records.reserve(estimatedRows);
+    chunk.arena = make_unique<LibraryArena>(estimatedRows * 2 * sizeof(TeachingAssistant) + text.size());
+
+    string scratch;
+    scratch.reserve(text.size());
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        string_view line = text.substr(0, end);
+        text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+        ++chunk.lines;
+
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty()) continue;
+        if (mayHaveHeader && chunk.lines == 1 && line.substr(0, 3) == "id,") continue;
+
+        Row row;
+        string error = splitRow(line, row, scratch);
+        if (error.empty()) error = parse(row, *chunk.arena, chunk.records);
+        if (!error.empty()) chunk.rejected.push_back({chunk.lines, move(error)});
+    }
+}
+
+// Split one CSV line; unescaped quoted fields are written to `scratch`,
+// which is pre-sized so the returned views stay valid
+static string splitRow(string_view line, Row& row, string& scratch) {
+    scratch.clear();
+    scratch.reserve(line.size());
+    size_t pos = 0;
+    while (true) {
+        if (row.count == kMaxFields) return "too many fields";
+        if (pos < line.size() && line[pos] == '"') {
+            size_t start = scratch.size();
+            for (++pos;; ++pos) {
+                if (pos >= line.size()) return "unterminated quoted field";
+                if (line[pos] == '"') {
+                    if (pos + 1 < line.size() && line[pos + 1] == '"') { scratch += '"'; ++pos; }
+                    else { ++pos; break; }
+                } else {
+                    scratch += line[pos];
+                }
+            }
+            row.fields[row.count++] = string_view(scratch).substr(start);
+            if (pos < line.size() && line[pos] != ',') return "text after closing quote";
+        } else {
+            size_t comma = line.find(',', pos);
+            row.fields[row.count++] = line.substr(pos, comma == string_view::npos ? string_view::npos : comma - pos);
+            pos = comma;
+        }
+        if (pos == string_view::npos || pos >= line.size()) return "";
+        ++pos; // skip the comma
+        if (pos == line.size()) { // trailing empty field
+            if (row.count == kMaxFields) return "too many fields";
+            row.fields[row.count++] = string_view();
+            return "";
+        }
+    }
+}
+
+template <typename N>
+static bool parseNumber(string_view field, N& value) {
+    auto result = from_chars(field.data(), field.data() + field.size(), value);
+    return result.ec == errc() && result.ptr == field.data() + field.size();
+}
+
+static bool parseBool(string_view field, bool& value) {
+    if (field == "1" || field == "true" || field == "yes" || field == "Yes")  { value = true;  return true; }
+    if (field == "0" || field == "false" || field == "no" || field == "No" || field.empty()) { value = false; return true; }
+    return false;
+}
+
+// Largest |balance| accepted; keeps the cent amount far inside int64
+static constexpr double kMaxBalance = 1e15;
+
+static string parseUser(const Row& row, LibraryArena& arena, vector<Person*>& out) {
+    if (row.count != 8) return "expected 8 fields, got " + to_string(row.count);
+    string_view id = row.fields[0], name = row.fields[1], email = row.fields[2], role = row.fields[3];
+    double balance = 0.0, discount = 0.8; // blank fields take the Student defaults
+    int maxBorrows = 2;
+    bool canApprove = false;
+    if (id.empty()) return "empty id";
+    if (!parseNumber(row.fields[4], balance) || !isfinite(balance) || fabs(balance) > kMaxBalance)
+        return "bad balance";
+    if (!row.fields[5].empty() && (!parseNumber(row.fields[5], maxBorrows) || maxBorrows < 0))
+        return "bad maxConcurrentBorrows";
+    if (!row.fields[6].empty() && (!parseNumber(row.fields[6], discount) || !(discount >= 0.0 && discount <= 1.0)))
+        return "bad discountFactor";
+    if (!parseBool(row.fields[7], canApprove)) return "bad canApprovePurchases";
+
+    if (role == "Student")
+        out.push_back(arena.create<Student>(id, name, email, balance, maxBorrows, discount));
+    else if (role == "Staff")
+        out.push_back(arena.create<Staff>(id, name, email, balance, canApprove));
+    else if (role == "TeachingAssistant")
+        out.push_back(arena.create<TeachingAssistant>(id, name, email, balance, maxBorrows, discount, canApprove));
+    else
+        return "unknown role '" + string(role) + "'";
+    return "";
+}
+
+static string parseItem(const Row& row, LibraryArena& arena, vector<LibraryItem*>& out) {
+    if (row.count != 3) return "expected 3 fields, got " + to_string(row.count);
+    string_view id = row.fields[0], title = row.fields[1], type = row.fields[2];
+    if (id.empty()) return "empty id";
+
+    if (type == "Book")          out.push_back(arena.create<Book>(id, title));
+    else if (type == "Magazine") out.push_back(arena.create<Magazine>(id, title));
+    else if (type == "DVD")      out.push_back(arena.create<DVD>(id, title));
+    else return "unknown item type '" + string(type) + "'";
+    return "";
+}
+};
+
+// ============================================================================
+// Function: crc32
+// Standard CRC-32 (IEEE 802.3, reflected) used to detect torn log records.
+// ============================================================================
+inline uint32_t crc32(const void* data, size_t length, uint32_t crc = 0) noexcept {
+    static const auto table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// ============================================================================
+// Struct: FeeEvent
+// One closed transaction as recorded in the TransactionLog.
+// ============================================================================
+struct FeeEvent {
+    string userId;
+    string itemId;
+    int32_t daysLate = 0;
+    Money fee;
+    Money balanceAfter; // borrower balance right after the deduction
+};
+
+// ============================================================================
+// Class: TransactionLog
+// Append-only write-ahead log of closed transactions with group commit.
+// append() only encodes the record into memory and returns its sequence
+// number (LSN). A background flusher writes everything pending with one
+// write() and one fdatasync() when either knob trips:
+// - maxBatch records are pending (throughput)
+// - the oldest pending record has waited maxDelay (latency bound)
+// waitDurable(lsn) blocks until that record is on disk.
+// Failure is permanent: after the first failed write() or fdatasync() the
+// log truncates the file back to the end of the last durable batch (best
+// effort), drops everything not yet durable, and from then on append()
+// throws and waitDurable() throws for any LSN past durableLsn(). Records
+// after a failed batch are never written, so a durable LSN always means
+// every earlier record is intact on disk.
+// Opening an existing log keeps its intact prefix: a torn or corrupt tail
+// (a crash mid-write) is truncated away before anything is appended, and
+// LSNs continue from the number of intact records, so LSN n is always the
+// n-th record of the file.
+// Record layout: u32 payload length | u32 CRC-32 of payload | payload,
+// payload = u16 len + user id | u16 len + item id | i32 daysLate |
+//           i64 fee cents | i64 balance cents   (native byte order)
+// IDs longer than kMaxIdLength bytes are rejected (length_error).
+// ============================================================================
+struct GroupCommitPolicy {
+    size_t maxBatch = 1024;               // flush once this many records are pending
+    chrono::microseconds maxDelay{2000};  // ... or once the oldest has waited this long
+};
+
+class TransactionLog {
+public:
+static constexpr size_t kMaxIdLength = 65535; // u16 length prefix
+
+explicit TransactionLog(const string& path, GroupCommitPolicy policy = GroupCommitPolicy())
+: policy_(policy) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) throw runtime_error("cannot open log " + path + ": " + strerror(errno));
+    try {
+        string bytes = readWholeFile(path);
+        uint64_t records = 0;
+        size_t intact = scan(bytes, [&](FeeEvent&&) { ++records; });
+        if (intact < bytes.size() && (ftruncate(fd_, off_t(intact)) != 0 || fdatasync(fd_) != 0))
+            throw runtime_error("cannot truncate torn tail of log " + path + ": " + strerror(errno));
+        durableSize_ = off_t(intact);
+        appended_ = durable_ = records;
+    } catch (...) {
+        ::close(fd_);
+        throw;
+    }
+    flusher_ = thread([this] { flushLoop(); });
+}
+
+TransactionLog(const TransactionLog&) = delete;
+TransactionLog& operator=(const TransactionLog&) = delete;
+
+// Flushes everything still pending before closing
+~TransactionLog() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    flusher_.join();
+    ::close(fd_);
+}
+
+// Log a processed (closed) transaction; returns its LSN
+uint64_t append(const BorrowTransaction& tx) {
+    if (tx.isOpened()) throw invalid_argument("only closed transactions are logged");
+    return append(tx.getUserId(), tx.getItemId(), tx.getDaysLate(),
+                  tx.getLateFeeCost(), tx.getBorrower().getBalance());
+}
+
+uint64_t append(const FeeEvent& event) {
+    return append(event.userId, event.itemId, event.daysLate, event.fee, event.balanceAfter);
+}
+
+// Block until every record up to `lsn` is durable
+void waitDurable(uint64_t lsn) {
+    unique_lock<mutex> lock(mutex_);
+    if (durable_ < lsn) wake_.notify_one();
+    durableChanged_.wait(lock, [&] { return durable_ >= lsn || failed_; });
+    if (durable_ < lsn) throw runtime_error("transaction log failed: " + failure_);
+}
+
+// Force out everything appended so far
+void sync() {
+    uint64_t lsn;
+    {
+        lock_guard<mutex> lock(mutex_);
+        lsn = appended_;
+        forceFlush_ = true;
+    }
+    waitDurable(lsn);
+}
+
+uint64_t durableLsn() const {
+    lock_guard<mutex> lock(mutex_);
+    return durable_;
+}
+
+// True once a write or sync has failed; the log then accepts nothing more
+bool failed() const {
+    lock_guard<mutex> lock(mutex_);
+    return failed_;
+}
+
+// Decode every intact record. Reading stops at the first torn or corrupt
+// record (e.g. a partial write at crash time).
+static vector<FeeEvent> readAll(const string& path) {
+    vector<FeeEvent> events;
+    scan(readWholeFile(path), [&](FeeEvent&& event) { events.push_back(move(event)); });
+    return events;
+}
+
+
+private:
+// Calls onRecord(event) for each intact record in order; returns the
+// byte offset just past the last one
+template <typename Fn>
+static size_t scan(string_view bytes, Fn&& onRecord) {
+    size_t pos = 0;
+    while (bytes.size() - pos >= 8) {
+        uint32_t length, checksum;
+        memcpy(&length, bytes.data() + pos, 4);
+        memcpy(&checksum, bytes.data() + pos + 4, 4);
+        if (bytes.size() - pos - 8 < length) break;
+        const char* payload = bytes.data() + pos + 8;
+        if (crc32(payload, length) != checksum) break;
+
+        FeeEvent event;
+        if (!decode(string_view(payload, length), event)) break;
+        onRecord(move(event));
+        pos += 8 + length;
+    }
+    return pos;
+}
+
+uint64_t append(string_view userId, string_view itemId, int32_t daysLate,
+                Money fee, Money balanceAfter) {
+    if (userId.size() > kMaxIdLength || itemId.size() > kMaxIdLength)
+        throw length_error("transaction log: ID longer than 65535 bytes");
+    lock_guard<mutex> lock(mutex_);
+    if (failed_) throw runtime_error("transaction log failed: " + failure_);
+
+    // Encode straight into pending_: header placeholder, payload, then patch the header
+    size_t start = pending_.size();
+    pending_.append(8, '\0');
+    auto put = [&](const void* data, size_t size) {
+        pending_.append(static_cast<const char*>(data), size);
+    };
+    auto putString = [&](string_view text) {
+        uint16_t size = static_cast<uint16_t>(text.size());
+        put(&size, sizeof(size));
+        put(text.data(), size);
+    };
+    putString(userId);
+    putString(itemId);
+    int64_t feeCents = fee.cents(), balanceCents = balanceAfter.cents();
+    put(&daysLate, sizeof(daysLate));
+    put(&feeCents, sizeof(feeCents));
+    put(&balanceCents, sizeof(balanceCents));
+    uint32_t length = static_cast<uint32_t>(pending_.size() - start - 8);
+    uint32_t header[2] = {length, crc32(pending_.data() + start + 8, length)};
+    memcpy(&pending_[start], header, sizeof(header));
+
+    if (pendingCount_ == 0) oldestPending_ = chrono::steady_clock::now();
+    ++pendingCount_;
+    if (pendingCount_ >= policy_.maxBatch) wake_.notify_one();
+    return ++appended_;
+}
+
+static bool decode(string_view payload, FeeEvent& event) {
+    auto take = [&](void* out, size_t size) {
+        if (payload.size() < size) return false;
+        memcpy(out, payload.data(), size);
+        payload.remove_prefix(size);
+        return true;
+    };
+    auto takeString = [&](string& out) {
+        uint16_t size;
+        if (!take(&size, sizeof(size)) || payload.size() < size) return false;
+        out.assign(payload.data(), size);
+        payload.remove_prefix(size);
+        return true;
+    };
+    int64_t feeCents, balanceCents;
+    if (!takeString(event.userId) || !takeString(event.itemId) ||
+        !take(&event.daysLate, sizeof(event.daysLate)) ||
+        !take(&feeCents, sizeof(feeCents)) || !take(&balanceCents, sizeof(balanceCents)))
+        return false;
+    event.fee = Money::fromCents(feeCents);
+    event.balanceAfter = Money::fromCents(balanceCents);
+    return payload.empty();
+}
+
+void flushLoop() {
+    string batch;
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        // Sleep until a batch fills, the oldest record hits maxDelay, or shutdown
+        while (!stopping_ && !forceFlush_ && pendingCount_ < policy_.maxBatch) {
+            if (pendingCount_ == 0) wake_.wait(lock);
+            else if (wake_.wait_until(lock, oldestPending_ + policy_.maxDelay) == cv_status::timeout) break;
+        }
+        forceFlush_ = false;
+        if (failed_) {
+            pending_.clear();
+            pendingCount_ = 0;
+        }
+        if (pendingCount_ == 0) {
+            if (stopping_) return;
+            continue;
+        }
+
+        batch.swap(pending_);
+        pendingCount_ = 0;
+        uint64_t batchEnd = appended_;
+        lock.unlock();
+
+        bool ok = writeAll(batch) && fdatasync(fd_) == 0;
+        int error = errno;
+        if (ok) {
+            durableSize_ += batch.size();
+        } else {
+            // Cut off the torn batch so the file ends on a record boundary
+            if (ftruncate(fd_, durableSize_) == 0) fdatasync(fd_);
+        }
+        batch.clear();
+
+        lock.lock();
+        if (ok) {
+            durable_ = batchEnd;
+        } else {
+            failed_ = true;
+            failure_ = strerror(error);
+            pending_.clear(); // nothing after a failed batch is ever written
+            pendingCount_ = 0;
+        }
+        durableChanged_.notify_all();
+    }
+}
+
+bool writeAll(const string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t written = ::write(fd_, data.data() + done, data.size() - done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+GroupCommitPolicy policy_;
+int fd_ = -1;
+thread flusher_;
+
+mutable mutex mutex_;
+condition_variable wake_;           // wakes the flusher
+condition_variable durableChanged_; // wakes waitDurable callers
+string pending_;                    // encoded records not yet written
+size_t pendingCount_ = 0;
+chrono::steady_clock::time_point oldestPending_;
+uint64_t appended_ = 0;             // LSN of the last appended record
+uint64_t durable_ = 0;              // LSN of the last synced record
+off_t durableSize_ = 0;             // file size after the last synced batch (flusher only)
+bool forceFlush_ = false;
+bool stopping_ = false;
+bool failed_ = false;               // poisoned by a failed write or sync
+string failure_;                    // strerror() of that failure
+};
+
+// ============================================================================
+// Function: balanceChecksum
+// Order-sensitive FNV-1a digest of every (user id, balance) in directory
+// order. Store it next to a log to verify a later replay.
+// ============================================================================
+inline uint64_t balanceChecksum(const UserDirectory& users) noexcept {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void* data, size_t size) {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    for (const Person* person : users) {
+        string_view id = person->idView();
+        int64_t cents = person->getBalance().cents();
+        mix(id.data(), id.size());
+        mix(&cents, sizeof(cents));
+    }
+    return hash;
+}
+
+// ============================================================================
+// Class: LogReplayer
+// Rebuilds balances from logged FeeEvents at startup.
+// Events are partitioned by a hash of the borrower ID and each partition
+// is replayed on its own thread. A borrower lives in exactly one
+// partition and its events are applied in log order with Person::deduct,
+// so the order-dependent clamp-at-zero result is the same as a serial
+// replay. Balances in `users` are the starting point (e.g. a snapshot);
+// pass the snapshot's logLsn() as `afterLsn` so the events it already
+// includes are skipped rather than charged twice. Only fee deductions are logged, so a deposit made after that starting
+// point shows up as balance mismatches on the depositor's later events.
+// ============================================================================
+class LogReplayer {
+public:
+struct Report {
+    size_t events = 0;             // events replayed
+    size_t skipped = 0;            // events at or before afterLsn
+    size_t partitions = 0;
+    double seconds = 0.0;
+    double eventsPerSecond = 0.0;
+    size_t unknownUsers = 0;       // events whose user is not in the directory
+    size_t balanceMismatches = 0;  // events whose logged balanceAfter differs from the replay
+    uint64_t checksum = 0;         // balanceChecksum() after replay
+    bool checksumVerified = false; // true if it matched the expected checksum
+};
+
+// events[i] is the record with LSN i + 1, as returned by TransactionLog::readAll
+static Report replay(const vector<FeeEvent>& events, UserDirectory& users,
+                     unsigned partitions = 0, optional<uint64_t> expectedChecksum = nullopt,
+                     uint64_t afterLsn = 0) {
+    if (afterLsn > events.size())
+        throw runtime_error("log ends at LSN " + to_string(events.size()) +
+                            ", before the starting LSN " + to_string(afterLsn));
+    if (partitions == 0) partitions = max(1u, thread::hardware_concurrency());
+    auto start = chrono::steady_clock::now();
+
+    // Bucket event indices by borrower, keeping log order inside each bucket
+    vector<vector<uint32_t>> buckets(partitions);
+    for (size_t i = afterLsn; i < events.size(); ++i)
+        buckets[hash<string_view>()(events[i].userId) % partitions].push_back(static_cast<uint32_t>(i));
+
+    vector<size_t> unknown(partitions), mismatched(partitions);
+    auto replayPartition = [&](unsigned p) {
+        for (uint32_t i : buckets[p]) {
+            const FeeEvent& event = events[i];
+            Person* person = users.find(event.userId);
+            if (!person) { ++unknown[p]; continue; }
+            person->deduct(event.fee);
+            if (person->getBalance() != event.balanceAfter) ++mismatched[p];
+        }
+    };
+    vector<thread> workers;
+    for (unsigned p = 1; p < partitions; ++p) workers.emplace_back(replayPartition, p);
+    replayPartition(0);
+    for (thread& worker : workers) worker.join();
+
+    Report report;
+    report.events = events.size() - afterLsn;
+    report.skipped = afterLsn;
+    report.partitions = partitions;
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report.eventsPerSecond = report.seconds > 0 ? report.events / report.seconds : 0.0;
+    for (unsigned p = 0; p < partitions; ++p) {
+        report.unknownUsers += unknown[p];
+        report.balanceMismatches += mismatched[p];
+    }
+    report.checksum = balanceChecksum(users);
+    report.checksumVerified = expectedChecksum && *expectedChecksum == report.checksum;
+    return report;
+}
+
+static Report replay(const string& logPath, UserDirectory& users,
+                     unsigned partitions = 0, optional<uint64_t> expectedChecksum = nullopt,
+                     uint64_t afterLsn = 0) {
+    return replay(TransactionLog::readAll(logPath), users, partitions, expectedChecksum, afterLsn);
+}
+};
+
+// ============================================================================
+// Enum: BorrowStatus
+// Outcome of a borrow attempt.
+// ============================================================================
+enum class BorrowStatus { Ok, LimitReached, ItemUnavailable };
+
+constexpr string_view borrowStatusName(BorrowStatus status) noexcept {
+    switch (status) {
+    case BorrowStatus::Ok:              return "Ok";
+    case BorrowStatus::LimitReached:    return "LimitReached";
+    case BorrowStatus::ItemUnavailable: return "ItemUnavailable";
+    }
+    return "";
+}
+
+// ============================================================================
+// Class: LoanIndex
+// Tracks open loans without a global lock:
+// - one atomic active-loan counter per user
+// - one atomic holder slot per item (the borrower's IdHandle, 0 = on shelf)
+// Both tables are HandleArrays indexed directly by IdHandle, so every
+// operation is O(1) and users or items created later are tracked too.
+// borrow() reserves a slot under the user's limit with a CAS, then claims
+// the item with a CAS; if the item is taken the reservation is rolled
+// back. A user's counter therefore never exceeds borrowLimit(), however
+// many desks check out at once. The price is a transient false
+// LimitReached: while one borrow() of a user at the limit's edge is
+// rolling back (its item was taken), a concurrent borrow() by the same
+// user can see the reservation and be refused. Retrying is safe.
+// ============================================================================
+class LoanIndex {
+public:
+// `initialHandles` only pre-allocates; the tables grow with the IdTable
+explicit LoanIndex(size_t initialHandles = 0) : loans_(initialHandles), holders_(initialHandles) {}
+
+BorrowStatus borrow(const Person& borrower, const LibraryItem& item) {
+    uint32_t user = slot(borrower.idHandle());
+    atomic<uint32_t>& loans = loans_[user];
+    atomic<uint32_t>& holder = holders_[slot(item.idHandle())];
+
+    // Fast refusal without touching the user's counter
+    if (holder.load(memory_order_acquire) != 0) return BorrowStatus::ItemUnavailable;
+
+    uint32_t limit = borrower.borrowLimit();
+    uint32_t active = loans.load(memory_order_relaxed);
+    do {
+        if (active >= limit) return BorrowStatus::LimitReached;
+    } while (!loans.compare_exchange_weak(active, active + 1,
+                                          memory_order_acq_rel, memory_order_relaxed));
+
+    uint32_t free = 0;
+    if (!holder.compare_exchange_strong(free, user, memory_order_acq_rel)) {
+        loans.fetch_sub(1, memory_order_acq_rel);
+        return BorrowStatus::ItemUnavailable;
+    }
+    return BorrowStatus::Ok;
+}
+
+// Release `item` if `borrower` holds it; returns false otherwise
+bool release(const Person& borrower, const LibraryItem& item) {
+    uint32_t user = slot(borrower.idHandle());
+    uint32_t expected = user;
+    if (!holders_[slot(item.idHandle())].compare_exchange_strong(expected, 0, memory_order_acq_rel))
+        return false;
+    loans_[user].fetch_sub(1, memory_order_acq_rel);
+    return true;
+}
+
+uint32_t activeLoans(const Person& borrower) const {
+    const atomic<uint32_t>* loans = loans_.find(slot(borrower.idHandle()));
+    return loans ? loans->load(memory_order_acquire) : 0;
+}
+
+// Handle of the user holding `item` (invalid if it is on the shelf)
+IdHandle holder(const LibraryItem& item) const {
+    const atomic<uint32_t>* holder = holders_.find(slot(item.idHandle()));
+    return IdHandle{holder ? holder->load(memory_order_acquire) : 0};
+}
+
+
+private:
+static uint32_t slot(IdHandle handle) {
+    if (!handle.valid()) throw invalid_argument("LoanIndex: invalid handle");
+    return handle.value;
+}
+
+HandleArray<atomic<uint32_t>> loans_;   // user handle -> active loans
+HandleArray<atomic<uint32_t>> holders_; // item handle -> borrower handle (0 = on shelf)
+};
+
+// ============================================================================
+// Class: DueDateWheel
+// Hierarchical timer wheel over library days.
+//   level 0: 7 day buckets        (fires within the coming week)
+//   level 1: 4 week buckets       (7 days each, up to 4 weeks out)
+//   level 2: 12 month buckets     (28 days each, up to 48 weeks out)
+//   overflow list                 (anything further away)
+// schedule() is O(1). Each day, advance() fires exactly the bucket for
+// that day; higher-level buckets are cascaded down when the day crosses a
+// week, month or year boundary. A timer within 48 weeks moves at most
+// three times; an overflow timer is re-filed every 336 days until it comes
+// within range, so the daily cost is proportional to the timers that change
+// state.
+// ============================================================================
+class DueDateWheel {
+public:
+struct Timer {
+    uint32_t key;        // caller-defined (CirculationDesk uses the item handle)
+    uint32_t generation; // caller-defined tag for lazy cancellation
+    LibraryDay fireDay;
+};
+
+explicit DueDateWheel(LibraryDay today = 0) : today_(today) {}
+
+// Fire `timer` when the wheel reaches timer.fireDay (next advance if already due)
+void schedule(const Timer& timer) {
+    LibraryDay delta = timer.fireDay - today_;
+    if (delta <= 0)                    due_.push_back(timer);
+    else if (delta < kDays)            days_[bucket(timer.fireDay, 1, kDays)].push_back(timer);
+    else if (delta < kDays * kWeeks)   weeks_[bucket(timer.fireDay, kDays, kWeeks)].push_back(timer);
+    else if (delta < kMonthDays * kMonths)
+                                       months_[bucket(timer.fireDay, kMonthDays, kMonths)].push_back(timer);
+    else                               overflow_.push_back(timer);
+}
+
+// Move forward `days` days, calling onFire(timer) for every timer that comes due
+template <typename Fn>
+void advance(LibraryDay days, Fn&& onFire) {
+    fire(due_, onFire);
+    for (LibraryDay d = 0; d < days; ++d) {
+        ++today_;
+        if (today_ % (kMonthDays * kMonths) == 0) cascade(overflow_);
+        if (today_ % kMonthDays == 0) cascade(months_[bucket(today_, kMonthDays, kMonths)]);
+        if (today_ % kDays == 0)      cascade(weeks_[bucket(today_, kDays, kWeeks)]);
+        fire(days_[bucket(today_, 1, kDays)], onFire);
+        fire(due_, onFire);
+    }
+}
+
+LibraryDay today() const noexcept { return today_; }
+
+
+private:
+static constexpr LibraryDay kDays = 7, kWeeks = 4, kMonthDays = 28, kMonths = 12;
+
+// Slot of the width-day period holding `day`; floors, so days before 0 work too
+static size_t bucket(LibraryDay day, LibraryDay width, LibraryDay count) noexcept {
+    LibraryDay period = day / width - (day % width < 0 ? 1 : 0);
+    LibraryDay slot = period % count;
+    return static_cast<size_t>(slot < 0 ? slot + count : slot);
+}
+
+void cascade(vector<Timer>& bucket) {
+    vector<Timer> moving;
+    moving.swap(bucket);
+    for (const Timer& timer : moving) schedule(timer);
+}
+
+template <typename Fn>
+void fire(vector<Timer>& bucket, Fn& onFire) {
+    while (!bucket.empty()) {
+        vector<Timer> firing;
+        firing.swap(bucket);
+        for (const Timer& timer : firing) onFire(timer);
+    }
+}
+
+LibraryDay today_;
+array<vector<Timer>, kDays> days_;
+array<vector<Timer>, kWeeks> weeks_;
+array<vector<Timer>, kMonths> months_;
+vector<Timer> overflow_;
+vector<Timer> due_; // scheduled at or before today; fired on the next advance
+};
+
+// ============================================================================
+// Class: AccrualEngine
+// Running totals of late fees that overdue loans have accrued but that
+// have not been charged yet (charging happens on return).
+// Each overdue loan remembers the discounted amount it currently adds to
+// its borrower's total; the daily tick recomputes that amount from the
+// per-kind fee rate and the borrower's Student discount and adds only the
+// difference. pending() is therefore O(1) and equals exactly what
+// returning every overdue loan today would charge; the tick is
+// O(overdue loans). Tables are HandleArrays indexed by IdHandle, like
+// LoanIndex, so they grow with the IdTable.
+// Not thread-safe on its own: CirculationDesk drives it under its lock.
+// ============================================================================
+class AccrualEngine {
+public:
+explicit AccrualEngine(size_t initialHandles = 0)
+: position_(initialHandles), pending_(initialHandles) {}
+
+// Start accruing for a loan that fell due on `dueDay`
+void startLoan(const Person& borrower, const LibraryItem& item, LibraryDay dueDay, LibraryDay today) {
+    uint32_t& position = position_[item.idHandle().value];
+    if (position != kNotAccruing) stopLoan(item);
+
+    AccruingLoan loan;
+    loan.user = borrower.idHandle().value;
+    loan.dueDay = dueDay;
+    loan.feePerDay = kindFeePerDay(item.kind());
+    loan.discount = borrower.hasRole(RoleStudent) ? borrower.feeDiscount() : Discount();
+    loan.item = item.idHandle().value;
+    pending_[loan.user]; // allocate before touching loans_, so a throw leaves no trace
+    position = static_cast<uint32_t>(loans_.size()) + 1;
+    loans_.push_back(loan);
+    update(loans_.back(), today);
+}
+
+// Stop accruing (the loan was returned and its fee charged)
+void stopLoan(const LibraryItem& item) {
+    uint32_t& position = position_[item.idHandle().value];
+    if (position == kNotAccruing) return;
+
+    AccruingLoan& loan = loans_[position - 1];
+    pending_[loan.user] -= loan.counted;
+    loan = loans_.back();
+    position_[loan.item] = position;
+    loans_.pop_back();
+    position = kNotAccruing;
+}
+
+// Bring every accruing loan up to `today`
+void advanceTo(LibraryDay today) {
+    for (AccruingLoan& loan : loans_) update(loan, today);
+}
+
+// Late fees `borrower` would be charged for loans returned today
+Money pending(const Person& borrower) const {
+    const Money* total = pending_.find(borrower.idHandle().value);
+    return total ? *total : Money();
+}
+
+size_t accruingLoans() const noexcept { return loans_.size(); }
+
+
+private:
+static constexpr uint32_t kNotAccruing = 0; // position_ holds index + 1
+
+struct AccruingLoan {
+    uint32_t user;
+    uint32_t item;
+    LibraryDay dueDay;
+    Money feePerDay;
+    Discount discount;
+    Money counted; // amount currently included in pending_[user]
+};
+
+void update(AccruingLoan& loan, LibraryDay today) {
+    Money accrued = loan.discount.apply(loan.feePerDay * max<LibraryDay>(0, today - loan.dueDay));
+    pending_[loan.user] += accrued - loan.counted;
+    loan.counted = accrued;
+}
+
+vector<AccruingLoan> loans_;
+HandleArray<uint32_t> position_; // item handle -> index into loans_ + 1
+HandleArray<Money> pending_;     // user handle -> pending total
+};
+
+// ============================================================================
+// Class: CirculationDesk
+// Borrow/return front end over a LoanIndex.
+// - borrow() enforces the borrower's limit and gives the loan a due day
+//   `loanPeriodDays` after today
+// - advanceDay() moves the calendar; the DueDateWheel flags loans as
+//   overdue the day after they fall due, without scanning open loans
+// - returnItem() releases the loan, derives days late from the due day
+//   and charges the fee through a BorrowTransaction
+// - pendingFees() reports fees accrued on a user's overdue loans (O(1))
+// Limit checks and item claims are lock-free (LoanIndex); due-day
+// bookkeeping and the wheel sit behind one short mutex. A loan becomes
+// returnable only once its due day is published under that mutex, and the
+// release happens under it too, so a return racing its own borrow sees
+// "not borrowed" rather than half-written state. Two threads must
+// not return loans of the same borrower concurrently (Person balances are
+// not atomic).
+// ============================================================================
+class CirculationDesk {
+public:
+// Called under the desk lock when a loan becomes overdue; must not call back into the desk
+using OverdueListener = function<void(Person& borrower, LibraryItem& item, LibraryDay dueDay)>;
+
+// `initialHandles` only pre-allocates; every table grows with the IdTable
+CirculationDesk(size_t initialHandles, LibraryDay loanPeriodDays = 14, LibraryDay today = 0)
+: loans_(initialHandles), meta_(initialHandles), wheel_(today), loanPeriod_(loanPeriodDays),
+accruals_(initialHandles) {}
+
+BorrowStatus borrow(Person& borrower, LibraryItem& item) {
+    BorrowStatus status = loans_.borrow(borrower, item);
+    if (status != BorrowStatus::Ok) return status;
+
+    lock_guard<mutex> lock(mutex_);
+    LoanMeta& meta = meta_[item.idHandle().value];
+    meta.borrower = &borrower;
+    meta.item = &item;
+    meta.dueDay = wheel_.today() + loanPeriod_;
+    meta.overdue = false;
+    ++meta.generation;
+    wheel_.schedule({item.idHandle().value, meta.generation, meta.dueDay + 1});
+    return status;
+}
+
+// Close the loan and charge the late fee; nullopt if `borrower` does not hold `item`
+optional<BorrowTransaction> returnItem(Person& borrower, LibraryItem& item) {
+    LibraryDay dueDay, today;
+    {
+        lock_guard<mutex> lock(mutex_);
+        LoanMeta* meta = meta_.find(item.idHandle().value);
+        if (!meta || meta->borrower != &borrower) return nullopt; // not borrowed, or borrow() still publishing
+        if (!loans_.release(borrower, item)) return nullopt;
+        dueDay = meta->dueDay;
+        today = wheel_.today();
+        if (meta->overdue) {
+            --overdueCount_;
+            accruals_.stopLoan(item);
+        }
+        meta->borrower = nullptr;
+        ++meta->generation; // cancels the pending wheel timer
+    }
+
+    BorrowTransaction tx(borrower, item, dueDay, today);
+    tx.process();
+    return tx;
+}
+
+// Move the calendar forward, flagging loans that become overdue and
+// accruing one more day of fees on every overdue loan
+void advanceDay(LibraryDay days = 1) {
+    lock_guard<mutex> lock(mutex_);
+    for (LibraryDay d = 0; d < days; ++d) {
+        wheel_.advance(1, [&](const DueDateWheel::Timer& timer) {
+            LoanMeta& meta = meta_[timer.key];
+            if (meta.generation != timer.generation || !meta.borrower) return; // returned meanwhile
+            meta.overdue = true;
+            ++overdueCount_;
+            accruals_.startLoan(*meta.borrower, *meta.item, meta.dueDay, wheel_.today());
+            if (onOverdue_) onOverdue_(*meta.borrower, *meta.item, meta.dueDay);
+        });
+        accruals_.advanceTo(wheel_.today());
+    }
+}
+
+// Late fees accrued on `borrower`'s overdue loans and not yet charged
+Money pendingFees(const Person& borrower) const {
+    lock_guard<mutex> lock(mutex_);
+    return accruals_.pending(borrower);
+}
+
+void setOverdueListener(OverdueListener listener) {
+    lock_guard<mutex> lock(mutex_);
+    onOverdue_ = move(listener);
+}
+
+// Due day of the open loan on `item` (nullopt if it is on the shelf)
+optional<LibraryDay> dueDay(const LibraryItem& item) const {
+    lock_guard<mutex> lock(mutex_);
+    const LoanMeta* meta = meta_.find(item.idHandle().value);
+    return meta && meta->borrower ? optional<LibraryDay>(meta->dueDay) : nullopt;
+}
+
+LibraryDay today() const {
+    lock_guard<mutex> lock(mutex_);
+    return wheel_.today();
+}
+
+size_t overdueCount() const {
+    lock_guard<mutex> lock(mutex_);
+    return overdueCount_;
+}
+
+const LoanIndex& loans() const noexcept { return loans_; }
+
+
+private:
+// Per-item loan state, indexed by the item's IdHandle
+struct LoanMeta {
+    Person* borrower = nullptr; // nullptr while the item is on the shelf
+    LibraryItem* item = nullptr;
+    LibraryDay dueDay = 0;
+    uint32_t generation = 0;    // bumped on every borrow/return
+    bool overdue = false;
+};
+
+LoanIndex loans_;
+mutable mutex mutex_;
+HandleArray<LoanMeta> meta_;
+DueDateWheel wheel_;
+LibraryDay loanPeriod_;
+size_t overdueCount_ = 0;
+OverdueListener onOverdue_;
+AccrualEngine accruals_;
+};
+
+// ============================================================================
+// Class: TitleIndex
+// Inverted full-text index over LibraryItem titles.
+// Titles are split into lowercase tokens (letters, digits, '+' and '#', so
+// "C++" stays searchable). Each token's posting list stores
+// (doc delta, term frequency) pairs as varints; documents are numbered
+// in insertion order, so add() only appends and never rewrites a list.
+// Queries are whitespace-separated terms; "term*" matches every token
+// with that prefix. Results are ranked by sum(tf * idf) over the query
+// terms, ties broken by insertion order.
+// ============================================================================
+class TitleIndex {
+public:
+enum class Match { All, Any }; // AND / OR across query terms
+
+struct Hit {
+    const LibraryItem* item;
+    double score;
+};
+
+// Index one item's title; returns its document number
+uint32_t add(const LibraryItem& item) {
+    uint32_t doc = static_cast<uint32_t>(docs_.size());
+    docs_.push_back(&item);
+
+    map<string, uint32_t> counts;
+    forEachToken(item.getTitle(), [&](string token) { ++counts[move(token)]; });
+    for (const auto& [token, frequency] : counts) {
+        PostingList& list = terms_[token];
+        putVarint(list.bytes, list.count == 0 ? doc : doc - list.lastDoc);
+        putVarint(list.bytes, frequency);
+        list.lastDoc = doc;
+        ++list.count;
+    }
+    return doc;
+}
+
+vector<Hit> search(string_view query, Match match = Match::All, size_t limit = 10) const {
+    vector<string> terms;
+    vector<bool> prefixes;
+    forEachToken(query, [&](string term) {
+        bool prefix = !term.empty() && term.back() == '*';
+        if (prefix) term.pop_back();
+        if (term.empty()) return;
+        terms.push_back(move(term));
+        prefixes.push_back(prefix);
+    }, true);
+
+    if (terms.empty()) return {};
+
+    vector<vector<Scored>> lists;
+    for (size_t t = 0; t < terms.size(); ++t) lists.push_back(termMatches(terms[t], prefixes[t]));
+    // Intersect rarest-first so intermediate results stay small
+    if (match == Match::All)
+        sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+
+    vector<Scored> result = move(lists[0]);
+    for (size_t t = 1; t < lists.size(); ++t) {
+        if (match == Match::All && result.empty()) break;
+        result = (match == Match::All) ? intersect(result, lists[t]) : unite(result, lists[t]);
+    }
+
+    size_t count = min(limit, result.size());
+    partial_sort(result.begin(), result.begin() + count, result.end(),
+                 [](const Scored& a, const Scored& b) {
+                     return a.score != b.score ? a.score > b.score : a.doc < b.doc;
+                 });
+    vector<Hit> hits;
+    hits.reserve(count);
+    for (size_t i = 0; i < count; ++i) hits.push_back({docs_[result[i].doc], result[i].score});
+    return hits;
+}
+
+size_t documentCount() const noexcept { return docs_.size(); }
+size_t termCount() const noexcept     { return terms_.size(); }
+
+
+private:
+struct PostingList {
+    string bytes;        // varint (doc delta, tf) pairs
+    uint32_t lastDoc = 0;
+    uint32_t count = 0;  // document frequency
+};
+
+struct Scored {
+    uint32_t doc;
+    double score;
+};
+
+static constexpr size_t kDenseShare = 16; // dense prefix merge once postings reach docs / 16
+
+static bool isTokenChar(char c) noexcept {
+    return isalnum(static_cast<unsigned char>(c)) || c == '+' || c == '#';
+}
+
+// Calls fn(token) for each lowercase token; `keepStar` keeps a trailing '*'
+template <typename Fn>
+static void forEachToken(string_view text, Fn&& fn, bool keepStar = false) {
+    string token;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        char c = i < text.size() ? text[i] : ' ';
+        if (isTokenChar(c)) {
+            token += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        } else {
+            if (keepStar && c == '*' && !token.empty()) token += '*';
+            if (!token.empty()) fn(move(token));
+            token.clear();
+        }
+    }
+}
+
+static void putVarint(string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static uint32_t getVarint(const char*& p) noexcept {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        auto byte = static_cast<uint8_t>(*p++);
+        value |= uint32_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+// Calls fn(doc, tf * idf) for each posting of `list`, ascending by doc
+template <typename Fn>
+void forEachPosting(const PostingList& list, Fn&& fn) const {
+    double idf = log(1.0 + double(docs_.size()) / list.count);
+    const char* p = list.bytes.data();
+    uint32_t doc = 0;
+    for (uint32_t i = 0; i < list.count; ++i) {
+        doc += getVarint(p);
+        fn(doc, getVarint(p) * idf);
+    }
+}
+
+// Decode one posting list into (doc, tf * idf) pairs, ascending by doc
+vector<Scored> decode(const PostingList& list) const {
+    vector<Scored> out;
+    out.reserve(list.count);
+    forEachPosting(list, [&](uint32_t doc, double score) { out.push_back({doc, score}); });
+    return out;
+}
+
+// A prefix can expand to thousands of terms. Their postings are merged in
+// one pass, never by re-merging the running result per term:
+// - few postings (under 1/kDenseShare of the documents): gather them all,
+//   stable-sort by document and sum neighbours, O(P log P) in the postings
+// - many postings: sum into a dense per-document array (every score is
+//   > 0, so 0 means "not matched") and sort the matched documents once
+// Either way scores are added in term order, so results do not depend on
+// which path ran.
+vector<Scored> termMatches(const string& term, bool prefix) const {
+    if (!prefix) {
+        auto found = terms_.find(term);
+        return found == terms_.end() ? vector<Scored>() : decode(found->second);
+    }
+    vector<const PostingList*> lists;
+    size_t postings = 0;
+    for (auto it = terms_.lower_bound(term);
+         it != terms_.end() && it->first.compare(0, term.size(), term) == 0; ++it) {
+        lists.push_back(&it->second);
+        postings += it->second.count;
+    }
+    if (lists.empty()) return {};
+    if (lists.size() == 1) return decode(*lists[0]);
+
+    vector<Scored> merged;
+    if (postings < docs_.size() / kDenseShare) {
+        vector<Scored> all;
+        all.reserve(postings);
+        for (const PostingList* list : lists)
+            forEachPosting(*list, [&](uint32_t doc, double score) { all.push_back({doc, score}); });
+        stable_sort(all.begin(), all.end(), [](const Scored& a, const Scored& b) { return a.doc < b.doc; });
+        for (const Scored& hit : all) {
+            if (!merged.empty() && merged.back().doc == hit.doc) merged.back().score += hit.score;
+            else merged.push_back(hit);
+        }
+        return merged;
+    }
+
+    vector<double> scores(docs_.size(), 0.0);
+    vector<uint32_t> matched;
+    for (const PostingList* list : lists) {
+        forEachPosting(*list, [&](uint32_t doc, double score) {
+            if (scores[doc] == 0.0) matched.push_back(doc);
+            scores[doc] += score;
+        });
+    }
+    sort(matched.begin(), matched.end());
+    merged.reserve(matched.size());
+    for (uint32_t doc : matched) merged.push_back({doc, scores[doc]});
+    return merged;
+}
+
+static vector<Scored> intersect(const vector<Scored>& a, const vector<Scored>& b) {
+    vector<Scored> out;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        if (a[i].doc < b[j].doc) ++i;
+        else if (b[j].doc < a[i].doc) ++j;
+        else out.push_back({a[i].doc, a[i++].score + b[j++].score});
+    }
+    return out;
+}
+
+static vector<Scored> unite(const vector<Scored>& a, const vector<Scored>& b) {
+    vector<Scored> out;
+    out.reserve(a.size() + b.size());
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        if (j == b.size() || (i < a.size() && a[i].doc < b[j].doc)) out.push_back(a[i++]);
+        else if (i == a.size() || b[j].doc < a[i].doc) out.push_back(b[j++]);
+        else out.push_back({a[i].doc, a[i++].score + b[j++].score});
+    }
+    return out;
+}
+
+vector<const LibraryItem*> docs_;
+map<string, PostingList, less<>> terms_; // ordered for prefix scans
+};
+
+// ============================================================================
+// Function: intersectSorted
+// Intersects two strictly increasing uint32 arrays into `out` (which must
+// hold min(na, nb) values); returns the number written. With SSE2 it
+// compares 4x4 blocks at once (each block of `a` against all rotations of
+// the block of `b`) and falls back to a scalar merge for the tails.
+// ============================================================================
+inline size_t intersectSorted(const uint32_t* a, size_t na,
+                              const uint32_t* b, size_t nb, uint32_t* out) noexcept {
+    size_t i = 0, j = 0, n = 0;
+#if defined(__SSE2__)
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        __m128i hit = _mm_cmpeq_epi32(va, vb);
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi32(va, vb));
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(hit));
+        for (int k = 0; k < 4; ++k)
+            if (mask & (1 << k)) out[n++] = a[i + k];
+
+        uint32_t lastA = a[i + 3], lastB = b[j + 3];
+        if (lastA <= lastB) i += 4;
+        if (lastB <= lastA) j += 4;
+    }
+#endif
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) ++i;
+        else if (b[j] < a[i]) ++j;
+        else { out[n++] = a[i]; ++i; ++j; }
+    }
+    return n;
+}
+
+// ============================================================================
+// Class: UserSearchIndex
+// Case-insensitive substring search over Person names and emails
+// (e.g. "mina@uni"). Every 3-byte window of each lowercased field is a
+// trigram with a sorted posting list of user numbers. A query intersects
+// the lists of its own trigrams, rarest first, and only the surviving
+// candidates are verified against the stored text, so queries of three or
+// more characters never scan the whole directory. Shorter queries have
+// no trigram and fall back to verifying every user.
+// ============================================================================
+class UserSearchIndex {
+public:
+// Index one user; returns its user number
+uint32_t add(const Person& person) {
+    uint32_t doc = static_cast<uint32_t>(users_.size());
+    users_.push_back(&person);
+
+    string text = lowercase(person.getName());
+    text += '\0'; // keeps trigrams and matches from spanning both fields
+    text += lowercase(person.getEmail());
+    for (size_t i = 0; i + 3 <= text.size(); ++i) {
+        if (memchr(text.data() + i, '\0', 3)) continue;
+        vector<uint32_t>& list = postings_[trigram(text.data() + i)];
+        if (list.empty() || list.back() != doc) list.push_back(doc);
+    }
+    texts_.push_back(move(text));
+    return doc;
+}
+
+// Users whose name or email contains `fragment` (case-insensitive), in insertion order
+vector<const Person*> search(string_view fragment, size_t limit = SIZE_MAX) const {
+    string needle = lowercase(fragment);
+    vector<const Person*> found;
+    if (needle.empty()) return found;
+
+    auto verify = [&](uint32_t doc) {
+        if (found.size() < limit && texts_[doc].find(needle) != string::npos)
+            found.push_back(users_[doc]);
+    };
+
+    if (needle.size() < 3) {
+        for (uint32_t doc = 0; doc < users_.size(); ++doc) verify(doc);
+        return found;
+    }
+
+    vector<const vector<uint32_t>*> lists;
+    for (size_t i = 0; i + 3 <= needle.size(); ++i) {
+        auto list = postings_.find(trigram(needle.data() + i));
+        if (list == postings_.end()) return found;
+        lists.push_back(&list->second);
+    }
+    sort(lists.begin(), lists.end(), [](auto* a, auto* b) { return a->size() < b->size(); });
+
+    vector<uint32_t> candidates(*lists[0]);
+    vector<uint32_t> scratch(candidates.size());
+    for (size_t l = 1; l < lists.size() && !candidates.empty(); ++l) {
+        size_t n = intersectSorted(candidates.data(), candidates.size(),
+                                   lists[l]->data(), lists[l]->size(), scratch.data());
+        candidates.assign(scratch.begin(), scratch.begin() + n);
+    }
+    for (uint32_t doc : candidates) verify(doc);
+    return found;
+}
+
+size_t size() const noexcept { return users_.size(); }
+
+
+private:
+static string lowercase(string_view text) {
+    string out(text);
+    for (char& c : out) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    return out;
+}
+
+static uint32_t trigram(const char* p) noexcept {
+    return uint32_t(uint8_t(p[0])) << 16 | uint32_t(uint8_t(p[1])) << 8 | uint8_t(p[2]);
+}
+
+vector<const Person*> users_;
+vector<string> texts_; // lowercase "name\0email" per user, for verification
+unordered_map<uint32_t, vector<uint32_t>> postings_;
+};
+
+// ============================================================================
+// Class: TransactionExecutor
+// Work-stealing pool that runs BorrowTransaction::process() on all cores.
+// Transactions are sharded by borrower handle into FIFO queues, so every
+// transaction of one borrower lands in the same shard. A shard with work
+// is scheduled on exactly one worker's ready deque at a time; workers take
+// from their own deque and, when idle, steal a WHOLE shard from another
+// worker's deque. Only one worker ever drains a given shard at once, so
+// each borrower's deductions apply in submission order (which matters
+// because deduct() clamps at zero) and no Person is touched concurrently.
+// Submitted transactions must stay alive until drain() returns, and
+// submit() must be called from one thread at a time.
+// ============================================================================
+class TransactionExecutor {
+public:
+explicit TransactionExecutor(unsigned workers = 0, unsigned shardsPerWorker = 8)
+: workerCount_(workers ? workers : max(1u, thread::hardware_concurrency())),
+shards_(size_t(workerCount_) * max(1u, shardsPerWorker)),
+ready_(workerCount_), groups_(shards_.size()) {
+    for (unsigned w = 0; w < workerCount_; ++w)
+        threads_.emplace_back([this, w] { workerLoop(w); });
+}
+
+TransactionExecutor(const TransactionExecutor&) = delete;
+TransactionExecutor& operator=(const TransactionExecutor&) = delete;
+
+~TransactionExecutor() {
+    drain();
+    {
+        lock_guard<mutex> lock(sleepMutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (thread& t : threads_) t.join();
+}
+
+// Queue one transaction behind everything already submitted for its borrower
+void submit(BorrowTransaction& tx) { submit(&tx, 1); }
+
+// Queue a batch; each shard is locked once per call
+void submit(BorrowTransaction* txs, size_t count) {
+    outstanding_.fetch_add(count, memory_order_relaxed);
+    touched_.clear();
+    for (size_t i = 0; i < count; ++i) {
+        size_t index = shardOf(txs[i]);
+        if (groups_[index].empty()) touched_.push_back(index);
+        groups_[index].push_back(&txs[i]);
+    }
+    for (size_t index : touched_) {
+        vector<BorrowTransaction*>& group = groups_[index];
+        Shard& shard = shards_[index];
+        bool schedule;
+        {
+            lock_guard<mutex> lock(shard.guard);
+            shard.pending.insert(shard.pending.end(), group.begin(), group.end());
+            schedule = !shard.scheduled;
+            shard.scheduled = true;
+        }
+        group.clear();
+        if (schedule) makeReady(index % workerCount_, index);
+    }
+}
+
+void submit(vector<BorrowTransaction>& txs) { submit(txs.data(), txs.size()); }
+
+// Block until every submitted transaction has been processed; returns the
+// total charged since the previous drain()
+Money drain() {
+    unique_lock<mutex> lock(sleepMutex_);
+    drained_.wait(lock, [this] { return outstanding_.load(memory_order_acquire) == 0; });
+    return Money::fromCents(charged_.exchange(0, memory_order_relaxed));
+}
+
+unsigned workerCount() const noexcept { return workerCount_; }
+size_t shardCount() const noexcept    { return shards_.size(); }
+uint64_t stolenShards() const noexcept { return stolen_.load(memory_order_relaxed); }
+
+
+private:
+struct Shard {
+    mutex guard;
+    vector<BorrowTransaction*> pending;
+    bool scheduled = false; // on some ready deque or being drained
+};
+
+struct ReadyQueue {
+    mutex guard;
+    deque<size_t> shards;
+};
+
+size_t shardOf(const BorrowTransaction& tx) const noexcept {
+    uint64_t key = tx.getUserHandle().value * 0x9E3779B97F4A7C15ull;
+    return (key >> 32) % shards_.size();
+}
+
+void makeReady(unsigned worker, size_t shard) {
+    {
+        lock_guard<mutex> lock(ready_[worker].guard);
+        ready_[worker].shards.push_back(shard);
+    }
+    {
+        lock_guard<mutex> lock(sleepMutex_);
+        ++readyCount_;
+    }
+    wake_.notify_one();
+}
+
+// Own deque first (LIFO for locality), then steal the oldest shard elsewhere
+optional<size_t> takeShard(unsigned self) {
+    for (unsigned k = 0; k < workerCount_; ++k) {
+        unsigned victim = (self + k) % workerCount_;
+        lock_guard<mutex> lock(ready_[victim].guard);
+        deque<size_t>& shards = ready_[victim].shards;
+        if (shards.empty()) continue;
+        size_t shard;
+        if (k == 0) { shard = shards.back(); shards.pop_back(); }
+        else        { shard = shards.front(); shards.pop_front(); stolen_.fetch_add(1, memory_order_relaxed); }
+        return shard;
+    }
+    return nullopt;
+}
+
+void workerLoop(unsigned self) {
+    vector<BorrowTransaction*> batch;
+    for (;;) {
+        {
+            unique_lock<mutex> lock(sleepMutex_);
+            wake_.wait(lock, [this] { return stopping_ || readyCount_ > 0; });
+            if (readyCount_ == 0) return; // stopping with nothing left
+            --readyCount_;
+        }
+        // readyCount_ counts deque entries, so a shard is waiting for us
+        optional<size_t> index;
+        while (!(index = takeShard(self))) this_thread::yield();
+        runShard(shards_[*index], batch);
+    }
+}
+
+// Drain one shard until it is empty, then unschedule it
+void runShard(Shard& shard, vector<BorrowTransaction*>& batch) {
+    for (;;) {
+        {
+            lock_guard<mutex> lock(shard.guard);
+            if (shard.pending.empty()) { shard.scheduled = false; return; }
+            batch.clear();
+            batch.swap(shard.pending);
+        }
+        Money total;
+        for (BorrowTransaction* tx : batch) total += tx->process();
+        charged_.fetch_add(total.cents(), memory_order_relaxed);
+        if (outstanding_.fetch_sub(batch.size(), memory_order_acq_rel) == batch.size()) {
+            lock_guard<mutex> lock(sleepMutex_);
+            drained_.notify_all();
+        }
+    }
+}
+
+unsigned workerCount_;
+vector<Shard> shards_;
+vector<ReadyQueue> ready_;
+vector<thread> threads_;
+vector<vector<BorrowTransaction*>> groups_; // submit() scratch, one per shard
+vector<size_t> touched_;                    // shards with a non-empty group
+
+mutex sleepMutex_;
+condition_variable wake_;
+condition_variable drained_;
+size_t readyCount_ = 0; // entries across all ready deques (guarded by sleepMutex_)
+bool stopping_ = false;
+
+atomic<size_t> outstanding_{0};
+atomic<int64_t> charged_{0};
+atomic<uint64_t> stolen_{0};
+};
+
+// ============================================================================
+// Namespace: wire
+// Binary protocol spoken by LibraryServer (host byte order, little-endian
+// on every supported target). Every message is one frame:
+//   u32 length   bytes that follow (tag + op/status + body)
+//   u32 tag      chosen by the client, echoed in the response
+//   u8  op       request opcode, or status in a response
+//   ...body
+// Strings are u16 length + bytes. Request bodies:
+//   LookupUser, Balance   str userId
+//   AddFunds              str userId, i64 cents (1..kMaxAddFundsCents)
+//   Borrow, Return        str userId, str itemId
+// Response bodies (status Ok only; errors carry no body):
+//   LookupUser            str name, str email, i64 balanceCents, u8 roles
+//   AddFunds, Balance     i64 balanceCents
+//   Borrow                i32 dueDay
+//   Return                i64 feeCents, i64 balanceCents
+// Clients may pipeline any number of frames; responses come back on the
+// same connection in request order.
+// ============================================================================
+namespace wire {
+
+enum class Op : uint8_t { LookupUser = 1, AddFunds = 2, Borrow = 3, Return = 4, Balance = 5 };
+
+enum class Status : uint8_t {
+    Ok = 0, UnknownUser, UnknownItem, LimitReached, ItemUnavailable, NotBorrowed, BadRequest,
+};
+
+constexpr size_t kPrefixSize = 4;          // the u32 length field
+constexpr size_t kMinFrame = 5;            // tag + op
+constexpr size_t kMaxFrame = 64 * 1024;    // larger frames close the connection
+
+// Appends one frame to a byte string; finish() patches the length prefix
+class FrameWriter {
+public:
+FrameWriter(string& out, uint32_t tag, uint8_t opOrStatus) : out_(out), start_(out.size()) {
+    out_.append(kPrefixSize, '\0');
+    put(tag);
+    put(opOrStatus);
+}
+
+template <typename T>
+FrameWriter& put(T value) {
+    static_assert(is_integral_v<T>, "wire fields are integers");
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    out_.append(bytes, sizeof(T));
+    return *this;
+}
+
+FrameWriter& putString(string_view text) {
+    size_t length = min(text.size(), size_t(UINT16_MAX));
+    put(static_cast<uint16_t>(length));
+    out_.append(text.data(), length);
+    return *this;
+}
+
+void finish() {
+    uint32_t length = static_cast<uint32_t>(out_.size() - start_ - kPrefixSize);
+    memcpy(&out_[start_], &length, sizeof(length));
+}
+
+
+private:
+string& out_;
+size_t start_;
+};
+
+// Reads fields from a frame body; any overrun clears ok() and yields zeros
+class FrameReader {
+public:
+explicit FrameReader(string_view body) noexcept : body_(body) {}
+
+template <typename T>
+T get() noexcept {
+    T value{};
+    if (body_.size() < sizeof(T)) { ok_ = false; return value; }
+    memcpy(&value, body_.data(), sizeof(T));
+    body_.remove_prefix(sizeof(T));
+    return value;
+}
+
+string_view getString() noexcept {
+    uint16_t length = get<uint16_t>();
+    if (!ok_ || body_.size() < length) { ok_ = false; return {}; }
+    string_view text = body_.substr(0, length);
+    body_.remove_prefix(length);
+    return text;
+}
+
+bool ok() const noexcept       { return ok_; }
+bool atEnd() const noexcept    { return body_.empty(); }
+
+
+private:
+string_view body_;
+bool ok_ = true;
+};
+
+// One complete frame at the front of `buffer`, if there is one
+struct Frame {
+    uint32_t tag;
+    uint8_t code;      // Op in requests, Status in responses
+    string_view body;
+    size_t size;       // bytes consumed, including the length prefix
+};
+
+// nullopt if more bytes are needed; throws length_error on an invalid length
+inline optional<Frame> parseFrame(string_view buffer) {
+    if (buffer.size() < kPrefixSize) return nullopt;
+    uint32_t length;
+    memcpy(&length, buffer.data(), sizeof(length));
+    if (length < kMinFrame || length > kMaxFrame) throw length_error("wire: bad frame length");
+    if (buffer.size() < kPrefixSize + length) return nullopt;
+
+    Frame frame;
+    memcpy(&frame.tag, buffer.data() + kPrefixSize, sizeof(frame.tag));
+    frame.code = static_cast<uint8_t>(buffer[kPrefixSize + 4]);
+    frame.body = buffer.substr(kPrefixSize + kMinFrame, length - kMinFrame);
+    frame.size = kPrefixSize + length;
+    return frame;
+}
+
+} // namespace wire
+
+// ============================================================================
+// Class: LibraryServer
+// Long-running request server on a Unix domain socket, driven by a single
+// epoll loop. Each readable event reads everything available, answers
+// every complete frame in it (pipelining) and sends all of the answers
+// with one write() (batching). Each event buffers at most
+// kMaxPendingInput unparsed bytes, and a connection whose unsent replies
+// pass kMaxPendingOutput stops being read until the client catches up.
+// Returns run through CirculationDesk::returnItem(), which processes the
+// BorrowTransaction. stop() is async-signal-safe. A stale socket left at
+// the path is replaced; any other file there makes the constructor throw.
+// ============================================================================
+class LibraryServer {
+public:
+static constexpr size_t kMaxPendingInput = 1 << 20;
+static constexpr size_t kMaxPendingOutput = 1 << 20;
+static constexpr int64_t kMaxAddFundsCents = 100'000'000; // $1,000,000 per request
+
+struct Stats {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t writes = 0; // reply batches sent
+};
+
+LibraryServer(const string& socketPath, UserDirectory& users, Catalog& items,
+              CirculationDesk& desk)
+: path_(socketPath), users_(users), items_(items), desk_(desk) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path_.size() >= sizeof(address.sun_path))
+        throw invalid_argument("socket path too long: " + path_);
+    memcpy(address.sun_path, path_.c_str(), path_.size() + 1);
+
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (epoll_ < 0 || wakeup_ < 0 || listener_ < 0) fail("cannot create server sockets");
+
+    struct stat existing;
+    if (lstat(path_.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            errno = EEXIST;
+            fail("refusing to replace non-socket " + path_);
+        }
+        unlink(path_.c_str());
+    }
+    if (bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+        fail("cannot bind " + path_);
+    if (listen(listener_, SOMAXCONN) != 0) fail("cannot listen on " + path_);
+    watch(listener_, EPOLLIN);
+    watch(wakeup_, EPOLLIN);
+}
+
+LibraryServer(const LibraryServer&) = delete;
+LibraryServer& operator=(const LibraryServer&) = delete;
+
+~LibraryServer() {
+    for (auto& entry : connections_) ::close(entry.first);
+    closeAll();
+    unlink(path_.c_str());
+}
+
+// Serve until stop() is called
+void run() {
+    epoll_event events[256];
+    while (!stopping_.load(memory_order_relaxed)) {
+        int ready = epoll_wait(epoll_, events, 256, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            fail("epoll_wait failed");
+        }
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listener_)      acceptAll();
+            else if (fd == wakeup_)   stopping_.store(true, memory_order_relaxed);
+            else                      onConnectionEvent(fd, events[i].events);
+        }
+    }
+}
+
+// Ask run() to return; safe from other threads and signal handlers
+void stop() noexcept {
+    stopping_.store(true, memory_order_relaxed);
+    uint64_t one = 1;
+    ssize_t ignored = ::write(wakeup_, &one, sizeof(one));
+    (void)ignored;
+}
+
+const Stats& stats() const noexcept { return stats_; }
+const string& path() const noexcept { return path_; }
+
+
+private:
+struct Connection {
+    string in;
+    string out;
+    size_t sent = 0;        // bytes of `out` already written
+    bool reading = true;    // EPOLLIN enabled
+    bool writing = false;   // EPOLLOUT enabled
+    bool peerClosed = false; // EOF seen; only draining `out`, EPOLLRDHUP disabled
+};
+
+[[noreturn]] void fail(const string& what) {
+    int error = errno;
+    closeAll();
+    throw runtime_error(what + ": " + strerror(error));
+}
+
+void closeAll() noexcept {
+    for (int* fd : {&listener_, &wakeup_, &epoll_})
+        if (*fd >= 0) { ::close(*fd); *fd = -1; }
+}
+
+void watch(int fd, uint32_t events) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) fail("epoll_ctl failed");
+}
+
+void rewatch(int fd, Connection& conn) {
+    epoll_event event{};
+    // EPOLLRDHUP stays ready after a half-close, so it is dropped once seen
+    event.events = (conn.reading ? EPOLLIN : 0u) | (conn.writing ? EPOLLOUT : 0u) |
+                   (conn.peerClosed ? 0u : EPOLLRDHUP);
+    event.data.fd = fd;
+    epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &event);
+}
+
+void acceptAll() {
+    for (;;) {
+        int fd = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return; // EAGAIN, or a transient error; retried on the next event
+        connections_.emplace(fd, Connection());
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) { drop(fd); continue; }
+        ++stats_.connections;
+    }
+}
+
+void drop(int fd) {
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    connections_.erase(fd);
+}
+
+void onConnectionEvent(int fd, uint32_t events) {
+    auto found = connections_.find(fd);
+    if (found == connections_.end()) return;
+    Connection& conn = found->second;
+
+    bool peerClosed = conn.peerClosed || (events & (EPOLLERR | EPOLLHUP)) != 0;
+    if (!conn.peerClosed && (events & (EPOLLIN | EPOLLRDHUP))) {
+        // Level-triggered: anything left past the cap is picked up next round
+        char chunk[64 * 1024];
+        while (conn.in.size() < kMaxPendingInput) {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n > 0) { conn.in.append(chunk, size_t(n)); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || errno != EAGAIN) peerClosed = true;
+            break;
+        }
+        try {
+            size_t consumed = 0;
+            while (auto frame = wire::parseFrame(string_view(conn.in).substr(consumed))) {
+                handle(*frame, conn.out);
+                consumed += frame->size;
+            }
+            conn.in.erase(0, consumed);
+        } catch (const length_error&) {
+            drop(fd); // framing is lost; nothing more can be parsed
+            return;
+        }
+    }
+    if (!flush(fd, conn) || (peerClosed && conn.sent == conn.out.size())) {
+        drop(fd);
+        return;
+    }
+
+    bool wantWrite = conn.sent < conn.out.size();
+    bool wantRead = !peerClosed && conn.out.size() - conn.sent < kMaxPendingOutput;
+    if (wantWrite != conn.writing || wantRead != conn.reading || peerClosed != conn.peerClosed) {
+        conn.writing = wantWrite;
+        conn.reading = wantRead;
+        conn.peerClosed = peerClosed;
+        rewatch(fd, conn);
+    }
+}
+
+// Write as much pending output as the socket takes; false on a hard error
+bool flush(int fd, Connection& conn) {
+    if (conn.sent == conn.out.size()) return true;
+    ++stats_.writes;
+    while (conn.sent < conn.out.size()) {
+        ssize_t n = ::send(fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+        if (n > 0) { conn.sent += size_t(n); continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        return false;
+    }
+    if (conn.sent == conn.out.size()) {
+        conn.out.clear();
+        conn.sent = 0;
+    }
+    return true;
+}
+
+void handle(const wire::Frame& frame, string& out) {
+    using wire::Op;
+    using wire::Status;
+    ++stats_.requests;
+
+    wire::FrameReader in(frame.body);
+    auto reply = [&](Status status) { return wire::FrameWriter(out, frame.tag, uint8_t(status)); };
+    auto bad = [&] { reply(Status::BadRequest).finish(); };
+
+    Person* person = users_.find(in.getString());
+    if (!in.ok()) return bad();
+
+    switch (static_cast<Op>(frame.code)) {
+    case Op::LookupUser:
+    case Op::Balance:
+        if (!in.atEnd()) return bad();
+        if (!person) return reply(Status::UnknownUser).finish();
+        if (static_cast<Op>(frame.code) == Op::Balance)
+            return reply(Status::Ok).put(person->getBalance().cents()).finish();
+        return reply(Status::Ok).putString(person->getName()).putString(person->getEmail())
+                                .put(person->getBalance().cents()).put(person->roles()).finish();
+
+    case Op::AddFunds: {
+        int64_t cents = in.get<int64_t>();
+        if (!in.ok() || !in.atEnd() || cents <= 0 || cents > kMaxAddFundsCents) return bad();
+        if (!person) return reply(Status::UnknownUser).finish();
+        if (person->getBalance().cents() > INT64_MAX - cents) return bad(); // would overflow
+        person->addFunds(Money::fromCents(cents));
+        return reply(Status::Ok).put(person->getBalance().cents()).finish();
+    }
+
+    case Op::Borrow:
+    case Op::Return: {
+        LibraryItem* item = items_.find(in.getString());
+        if (!in.ok() || !in.atEnd()) return bad();
+        if (!person) return reply(Status::UnknownUser).finish();
+        if (!item) return reply(Status::UnknownItem).finish();
+
+        if (static_cast<Op>(frame.code) == Op::Borrow) {
+            switch (desk_.borrow(*person, *item)) {
+            case BorrowStatus::Ok:
+                return reply(Status::Ok).put(int32_t(desk_.dueDay(*item).value_or(0))).finish();
+            case BorrowStatus::LimitReached:    return reply(Status::LimitReached).finish();
+            case BorrowStatus::ItemUnavailable: return reply(Status::ItemUnavailable).finish();
+            }
+            return bad(); // not a BorrowStatus
+        }
+        optional<BorrowTransaction> tx = desk_.returnItem(*person, *item);
+        if (!tx) return reply(Status::NotBorrowed).finish();
+        return reply(Status::Ok).put(tx->getLateFeeCost().cents())
+                                .put(person->getBalance().cents()).finish();
+    }
+    }
+    bad(); // unknown opcode
+}
+
+string path_;
+UserDirectory& users_;
+Catalog& items_;
+CirculationDesk& desk_;
+int epoll_ = -1;
+int wakeup_ = -1;
+int listener_ = -1;
+atomic<bool> stopping_{false};
+unordered_map<int, Connection> connections_;
+Stats stats_;
+};
+
+// ============================================================================
+// Staged return pipeline (C++20 coroutines)
+// Return processing as six stages, each a coroutine running on its own
+// single-thread StageExecutor and connected by bounded Channels:
+//   parse -> resolve -> fee -> discount -> deduct -> persist
+// A stage that pushes into a full channel suspends (backpressure) and is
+// resumed on its own executor once the next stage pops, so a slow stage
+// only holds back its producers after its input queue fills. Give the
+// persist queue more room to ride out slow flushes without stalling fee
+// computation. Only the deduct stage touches balances, so deductions
+// apply in input order. Built only when the compiler supports coroutines
+// (-std=c++20); the C++17 build leaves it out.
+// ============================================================================
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+// Single worker thread running posted coroutine resumptions in FIFO order
+class StageExecutor {
+public:
+StageExecutor() : worker_([this] { loop(); }) {}
+
+StageExecutor(const StageExecutor&) = delete;
+StageExecutor& operator=(const StageExecutor&) = delete;
+
+~StageExecutor() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_one();
+    worker_.join();
+}
+
+void post(coroutine_handle<> handle) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back(handle);
+    }
+    ready_.notify_one();
+}
+
+// Executor of the calling thread (nullptr outside any executor)
+static StageExecutor*& current() noexcept {
+    thread_local StageExecutor* executor = nullptr;
+    return executor;
+}
+
+
+private:
+void loop() {
+    current() = this;
+    for (;;) {
+        coroutine_handle<> handle;
+        {
+            unique_lock<mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            handle = queue_.front();
+            queue_.pop_front();
+        }
+        handle.resume();
+    }
+}
+
+mutex mutex_;
+condition_variable ready_;
+deque<coroutine_handle<>> queue_;
+bool stopping_ = false;
+thread worker_; // last: starts after the queue exists
+};
+
+// ============================================================================
+// Class: Channel<T>
+// Bounded MPMC queue between coroutine stages. co_await push(v) suspends
+// while the channel is full; co_await pop() suspends while it is empty
+// and yields nullopt once the channel is closed and drained. A consumer
+// that gives up calls cancel(): queued items are dropped and every waiting
+// or later push yields false, so producers can stop too. Suspended
+// coroutines are resumed on the executor they were suspended on.
+// ============================================================================
+template <typename T>
+class Channel {
+public:
+explicit Channel(size_t capacity) : capacity_(max<size_t>(1, capacity)) {}
+
+class PushAwaiter {
+public:
+PushAwaiter(Channel& channel, T value) : channel_(channel), value_(move(value)) {}
+
+bool await_ready() const noexcept { return false; }
+
+bool await_suspend(coroutine_handle<> handle) {
+    lock_guard<mutex> lock(channel_.mutex_);
+    if (channel_.canceled_) {
+        accepted_ = false;
+        return false;
+    }
+    if (!channel_.poppers_.empty()) {          // hand straight to a waiting consumer
+        Waiter<optional<T>> popper = channel_.poppers_.front();
+        channel_.poppers_.pop_front();
+        *popper.slot = move(value_);
+        popper.executor->post(popper.handle);
+        return false;
+    }
+    if (channel_.items_.size() < channel_.capacity_) {
+        channel_.items_.push_back(move(value_));
+        return false;
+    }
+    ++channel_.fullWaits_;
+    channel_.pushers_.push_back({handle, StageExecutor::current(), this});
+    return true;
+}
+
+// False if the channel was canceled and the value dropped
+bool await_resume() const noexcept { return accepted_; }
+
+
+private:
+friend class Channel;
+
+Channel& channel_;
+T value_;
+bool accepted_ = true;
+};
+
+class PopAwaiter {
+public:
+explicit PopAwaiter(Channel& channel) : channel_(channel) {}
+
+bool await_ready() const noexcept { return false; }
+
+bool await_suspend(coroutine_handle<> handle) {
+    lock_guard<mutex> lock(channel_.mutex_);
+    if (!channel_.items_.empty()) {
+        result_ = move(channel_.items_.front());
+        channel_.items_.pop_front();
+        if (!channel_.pushers_.empty()) {      // a slot opened up for a blocked producer
+            Waiter<PushAwaiter> pusher = channel_.pushers_.front();
+            channel_.pushers_.pop_front();
+            channel_.items_.push_back(move(pusher.slot->value_));
+            pusher.executor->post(pusher.handle);
+        }
+        return false;
+    }
+    if (channel_.closed_) return false;
+    channel_.poppers_.push_back({handle, StageExecutor::current(), &result_});
+    return true;
+}
+
+optional<T> await_resume() noexcept { return move(result_); }
+
+
+private:
+Channel& channel_;
+optional<T> result_;
+};
+
+PushAwaiter push(T value) { return PushAwaiter(*this, move(value)); }
+PopAwaiter pop()          { return PopAwaiter(*this); }
+
+// No more pushes; waiting consumers wake up with nullopt
+void close() {
+    lock_guard<mutex> lock(mutex_);
+    closed_ = true;
+    for (Waiter<optional<T>>& popper : poppers_) popper.executor->post(popper.handle);
+    poppers_.clear();
+}
+
+// Consumer side: drop queued items, fail waiting and later pushes, and
+// wake waiting consumers with nullopt
+void cancel() {
+    lock_guard<mutex> lock(mutex_);
+    closed_ = canceled_ = true;
+    items_.clear();
+    for (Waiter<PushAwaiter>& pusher : pushers_) {
+        pusher.slot->accepted_ = false;
+        pusher.executor->post(pusher.handle);
+    }
+    pushers_.clear();
+    for (Waiter<optional<T>>& popper : poppers_) popper.executor->post(popper.handle);
+    poppers_.clear();
+}
+
+// Times a producer found the channel full and had to suspend
+uint64_t fullWaits() const {
+    lock_guard<mutex> lock(mutex_);
+    return fullWaits_;
+}
+
+
+private:
+template <typename Slot>
+struct Waiter {
+    coroutine_handle<> handle;
+    StageExecutor* executor;
+    Slot* slot;
+};
+
+mutable mutex mutex_;
+size_t capacity_;
+deque<T> items_;
+deque<Waiter<PushAwaiter>> pushers_; // producers blocked on a full channel
+deque<Waiter<optional<T>>> poppers_; // consumers blocked on an empty channel
+bool closed_ = false;
+bool canceled_ = false;
+uint64_t fullWaits_ = 0;
+};
+
+// ============================================================================
+// Class: ReturnPipeline
+// Runs return records ("userId,itemId,daysLate" lines) through the six
+// stages above; each record is charged exactly as BorrowTransaction::
+// process() would charge it, and the resulting FeeEvent is handed to the
+// persist callback (e.g. TransactionLog::append). run() blocks until every
+// stage has finished and reports per-stage throughput.
+// If the persist callback throws (e.g. a failed TransactionLog), the run
+// stops: the error is kept in Report::persistError, each stage cancels its
+// input so its producer winds down, and run() returns. Records that were
+// already charged but never persisted are counted in Report::unpersisted.
+// ============================================================================
+class ReturnPipeline {
+public:
+using PersistFn = function<void(const FeeEvent&)>;
+
+struct StageReport {
+    string_view name;
+    size_t items = 0;       // records this stage passed on
+    double seconds = 0.0;   // from its first to its last record
+    double itemsPerSecond = 0.0;
+    uint64_t outputStalls = 0; // times its output queue was full
+};
+
+struct Report {
+    vector<StageReport> stages;
+    size_t malformed = 0;     // lines that did not parse
+    size_t unknownIds = 0;    // lines naming an unknown user or item
+    Money charged;
+    size_t unpersisted = 0;   // charged records the persist stage never took
+    string persistError;      // empty unless the persist callback threw
+};
+
+ReturnPipeline(UserDirectory& users, Catalog& items, PersistFn persist,
+               size_t queueCapacity = 1024, size_t persistQueueCapacity = 64 * 1024)
+: users_(users), items_(items), persist_(move(persist)),
+queueCapacity_(queueCapacity), persistQueueCapacity_(persistQueueCapacity) {}
+
+ReturnPipeline(UserDirectory& users, Catalog& items, TransactionLog& log,
+               size_t queueCapacity = 1024, size_t persistQueueCapacity = 64 * 1024)
+: ReturnPipeline(users, items, [&log](const FeeEvent& event) { log.append(event); },
+                 queueCapacity, persistQueueCapacity) {}
+
+Report run(const vector<string>& lines) {
+    Channel<Parsed> parsed(queueCapacity_);
+    Channel<Charge> resolved(queueCapacity_), priced(queueCapacity_), discounted(queueCapacity_);
+    Channel<FeeEvent> deducted(persistQueueCapacity_);
+
+    Report report;
+    report.stages.resize(6);
+    const char* names[] = {"parse", "resolve", "fee", "discount", "deduct", "persist"};
+    for (size_t s = 0; s < 6; ++s) report.stages[s].name = names[s];
+
+    size_t deductions = 0;
+    Completion done(6);
+    StageExecutor executors[6];
+    StageTask tasks[] = {
+        parseStage(lines, parsed, report.stages[0], report.malformed),
+        resolveStage(parsed, resolved, report.stages[1], report.unknownIds),
+        feeStage(resolved, priced, report.stages[2]),
+        discountStage(priced, discounted, report.stages[3]),
+        deductStage(discounted, deducted, report.stages[4], report.charged, deductions),
+        persistStage(deducted, report.stages[5], report.persistError),
+    };
+    for (size_t s = 0; s < 6; ++s) {
+        tasks[s].handle.promise().done = &done;
+        executors[s].post(tasks[s].handle);
+    }
+    done.wait();
+    report.unpersisted = deductions - report.stages[5].items;
+
+    Channel<Charge>* charges[] = {&resolved, &priced, &discounted};
+    report.stages[0].outputStalls = parsed.fullWaits();
+    for (size_t s = 1; s < 4; ++s) report.stages[s].outputStalls = charges[s - 1]->fullWaits();
+    report.stages[4].outputStalls = deducted.fullWaits();
+    for (StageReport& stage : report.stages)
+        stage.itemsPerSecond = stage.seconds > 0 ? stage.items / stage.seconds : 0.0;
+    return report;
+}
+
+
+private:
+struct Parsed {
+    string_view userId;
+    string_view itemId;
+    int32_t daysLate;
+};
+
+struct Charge {
+    Person* borrower;
+    LibraryItem* item;
+    int32_t daysLate;
+    Money fee;
+};
+
+// Counts finished stages; wait() returns once all have finished
+class Completion {
+public:
+explicit Completion(size_t count) : remaining_(count) {}
+
+void arrive() {
+    lock_guard<mutex> lock(mutex_);
+    if (--remaining_ == 0) finished_.notify_all();
+}
+
+void wait() {
+    unique_lock<mutex> lock(mutex_);
+    finished_.wait(lock, [this] { return remaining_ == 0; });
+}
+
+
+private:
+mutex mutex_;
+condition_variable finished_;
+size_t remaining_;
+};
+
+// Coroutine owning one stage: starts suspended, reports to `done` once
+// fully suspended at the end, and is destroyed with the task object
+struct StageTask {
+    struct promise_type {
+        Completion* done = nullptr;
+
+        StageTask get_return_object() {
+            return StageTask{coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct Finish {
+                bool await_ready() noexcept { return false; }
+                void await_suspend(coroutine_handle<promise_type> handle) noexcept {
+                    handle.promise().done->arrive();
+                }
+                void await_resume() noexcept {}
+            };
+            return Finish{};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() { terminate(); }
+    };
+
+    explicit StageTask(coroutine_handle<promise_type> h) : handle(h) {}
+    StageTask(StageTask&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    StageTask(const StageTask&) = delete;
+    ~StageTask() { if (handle) handle.destroy(); }
+
+    coroutine_handle<promise_type> handle;
+};
+
+// Wall-clock span from a stage's first to its last record
+class StageClock {
+public:
+explicit StageClock(StageReport& report) : report_(report) {}
+
+void tick() {
+    auto now = chrono::steady_clock::now();
+    if (report_.items++ == 0) start_ = now;
+    report_.seconds = chrono::duration<double>(now - start_).count();
+}
+
+
+private:
+StageReport& report_;
+chrono::steady_clock::time_point start_;
+};
+
+StageTask parseStage(const vector<string>& lines, Channel<Parsed>& out,
+                     StageReport& report, size_t& malformed) {
+    StageClock clock(report);
+    for (const string& line : lines) {
+        string_view rest = line;
+        size_t first = rest.find(','), second = rest.find(',', first + 1);
+        int32_t daysLate = 0;
+        if (first == string_view::npos || second == string_view::npos) { ++malformed; continue; }
+        string_view days = rest.substr(second + 1);
+        auto [end, error] = from_chars(days.data(), days.data() + days.size(), daysLate);
+        if (error != errc() || end != days.data() + days.size() || daysLate < 0) {
+            ++malformed;
+            continue;
+        }
+        if (!co_await out.push({rest.substr(0, first), rest.substr(first + 1, second - first - 1), daysLate}))
+            break; // downstream gave up
+        clock.tick();
+    }
+    out.close();
+}
+
+StageTask resolveStage(Channel<Parsed>& in, Channel<Charge>& out,
+                       StageReport& report, size_t& unknownIds) {
+    StageClock clock(report);
+    for (;;) {
+        optional<Parsed> record = co_await in.pop();
+        if (!record) break;
+        Person* borrower = users_.find(record->userId);
+        LibraryItem* item = items_.find(record->itemId);
+        if (!borrower || !item) { ++unknownIds; continue; }
+        if (!co_await out.push({borrower, item, record->daysLate, Money()})) {
+            in.cancel();
+            break;
+        }
+        clock.tick();
+    }
+    out.close();
+}
+
+StageTask feeStage(Channel<Charge>& in, Channel<Charge>& out, StageReport& report) {
+    StageClock clock(report);
+    for (;;) {
+        optional<Charge> charge = co_await in.pop();
+        if (!charge) break;
+        charge->fee = charge->item->computeLateFee(charge->daysLate);
+        if (!co_await out.push(*charge)) {
+            in.cancel();
+            break;
+        }
+        clock.tick();
+    }
+    out.close();
+}
+
+StageTask discountStage(Channel<Charge>& in, Channel<Charge>& out, StageReport& report) {
+    StageClock clock(report);
+    for (;;) {
+        optional<Charge> charge = co_await in.pop();
+        if (!charge) break;
+        if (charge->borrower->hasRole(RoleStudent))
+            charge->fee = charge->borrower->feeDiscount().apply(charge->fee);
+        if (!co_await out.push(*charge)) {
+            in.cancel();
+            break;
+        }
+        clock.tick();
+    }
+    out.close();
+}
+
+StageTask deductStage(Channel<Charge>& in, Channel<FeeEvent>& out,
+                      StageReport& report, Money& charged, size_t& deductions) {
+    StageClock clock(report);
+    for (;;) {
+        optional<Charge> charge = co_await in.pop();
+        if (!charge) break;
+        charge->borrower->deduct(charge->fee);
+        charged += charge->fee;
+        ++deductions;
+        // Built as a named local: GCC 12 double-frees aggregate temporaries
+        // of non-trivial types inside a co_await operand
+        FeeEvent event{string(charge->borrower->idView()), string(charge->item->idView()),
+                       charge->daysLate, charge->fee, charge->borrower->getBalance()};
+        if (!co_await out.push(move(event))) {
+            in.cancel();
+            break;
+        }
+        clock.tick();
+    }
+    out.close();
+}
+
+StageTask persistStage(Channel<FeeEvent>& in, StageReport& report, string& error) {
+    StageClock clock(report);
+    for (;;) {
+        optional<FeeEvent> event = co_await in.pop();
+        if (!event) break;
+        try {
+            if (persist_) persist_(*event);
+        } catch (const exception& e) {
+            error = e.what();
+            in.cancel(); // upstream stages stop at their next push
+            break;
+        }
+        clock.tick();
+    }
+}
+
+UserDirectory& users_;
+Catalog& items_;
+PersistFn persist_;
+size_t queueCapacity_;
+size_t persistQueueCapacity_;
+};
+
+#endif // __cpp_impl_coroutine
+
+#ifdef LIBRARY_BENCH
+// ============================================================================
+// BENCHMARKS (library_bench)
+// Built instead of the demo when compiled with -DLIBRARY_BENCH:
+//     g++ -std=c++17 -O2 -DLIBRARY_BENCH library_system.cpp -o library_bench
+//     ./library_bench [--min N] [--max N] [--out results.json]
+// Every case runs at populations min, 10*min, ... up to max
+// (default 1K to 1M; pass --max 10000000 for the 10M tier).
+// Results are written as JSON (ns/op, allocations/op, bytes/op) so two
+// builds can be diffed.
+// ============================================================================
+#include <cstdlib>
+#include <new>
+
+// ------------------------------------------------------------
+// Allocation counting: replace global new/delete for this build only
+// ------------------------------------------------------------
+namespace benchalloc {
+atomic<uint64_t> count{0};
+atomic<uint64_t> bytes{0};
+
+inline void record(size_t size) noexcept {
+    count.fetch_add(1, memory_order_relaxed);
+    bytes.fetch_add(size, memory_order_relaxed);
+}
+} // namespace benchalloc
+
+void* operator new(size_t size) {
+    benchalloc::record(size);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+    benchalloc::record(size);
+    size_t align = static_cast<size_t>(alignment);
+    if (void* p = aligned_alloc(align, (size + align - 1) / align * align)) return p;
+    throw bad_alloc();
+}
+
+// GCC cannot see that these pair with the malloc-based operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept                        { free(p); }
+void operator delete(void* p, size_t) noexcept                { free(p); }
+void operator delete(void* p, align_val_t) noexcept           { free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept   { free(p); }
+#pragma GCC diagnostic pop
+
+// Keep a value alive so the optimizer cannot drop the measured work
+template <typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Discount lookup the way BorrowTransaction::process() used to do it
+uint32_t discountViaDynamicCast(Person* p) {
+    if (auto* s = dynamic_cast<Student*>(p)) return s->getDiscount().basisPoints();
+    return Discount().basisPoints();
+}
+
+// Discount lookup through the cached role tag
+uint32_t discountViaRoleTag(Person* p) {
+    return p->hasRole(RoleStudent) ? p->feeDiscount().basisPoints() : Discount().basisPoints();
+}
+
+// Stream buffer that discards everything (used to time display())
+class NullBuffer : public streambuf {
+protected:
+int overflow(int c) override                          { return c; }
+streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// ============================================================================
+// Class: BenchSuite
+// Times one case at a time and collects results for the JSON report.
+// ============================================================================
+class BenchSuite {
+public:
+struct Result {
+    string name;
+    size_t population;
+    double nsPerOp;
+    double allocsPerOp;
+    double bytesPerOp;
+};
+
+// Run `body` once; it must perform `ops` operations
+template <typename Fn>
+void run(const string& name, size_t population, size_t ops, Fn&& body) {
+    uint64_t allocs = benchalloc::count.load(memory_order_relaxed);
+    uint64_t bytes  = benchalloc::bytes.load(memory_order_relaxed);
+    auto start = chrono::steady_clock::now();
+    body();
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    allocs = benchalloc::count.load(memory_order_relaxed) - allocs;
+    bytes  = benchalloc::bytes.load(memory_order_relaxed) - bytes;
+
+    results_.push_back({name, population, elapsed.count() / ops,
+                        double(allocs) / ops, double(bytes) / ops});
+    cerr << name << " @" << population << ": " << results_.back().nsPerOp << " ns/op\n";
+}
+
+void writeJson(ostream& os) const {
+    os << "{\n  \"kernel\": \"" << lateFeeKernelName() << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results_.size(); ++i) {
+        const Result& r = results_[i];
+        os << "    {\"name\": \"" << r.name << "\", \"population\": " << r.population
+           << ", \"ns_per_op\": " << r.nsPerOp
+           << ", \"allocs_per_op\": " << r.allocsPerOp
+           << ", \"bytes_per_op\": " << r.bytesPerOp << "}"
+           << (i + 1 < results_.size() ? ",\n" : "\n");
+    }
+    os << "  ]\n}\n";
+}
+
+
+private:
+vector<Result> results_;
+};
+
+// Pre-built ID strings so ID formatting is not part of the timed work
+vector<string> makeIds(char prefix, size_t n) {
+    vector<string> ids;
+    ids.reserve(n);
+    for (size_t i = 0; i < n; ++i) ids.push_back(prefix + to_string(i));
+    return ids;
+}
+
+template <typename T>
+unique_ptr<Person> makePerson(const string& id) {
+    if constexpr (is_same_v<T, TeachingAssistant>)
+        return make_unique<T>(id, "Lina", "lina@uni.edu", 1e6, 2, 0.85, true);
+    else if constexpr (is_same_v<T, Student>)
+        return make_unique<T>(id, "Amina", "amina@uni.edu", 1e6, 2, 0.8);
+    else
+        return make_unique<T>(id, "Omar", "omar@uni.edu", 1e6, true);
+}
+
+// construct/<Type>: N heap-allocated users of one subtype
+template <typename T>
+vector<unique_ptr<Person>> benchConstruct(BenchSuite& suite, const char* name,
+                                          const vector<string>& ids) {
+    vector<unique_ptr<Person>> people;
+    people.reserve(ids.size());
+    suite.run(string("construct/") + name, ids.size(), ids.size(), [&] {
+        for (const string& id : ids) people.push_back(makePerson<T>(id));
+    });
+    return people;
+}
+
+// process/<Type>: one late Book return per borrower
+void benchProcess(BenchSuite& suite, const char* name,
+                  vector<unique_ptr<Person>>& people, LibraryItem& item) {
+    vector<BorrowTransaction> txs;
+    txs.reserve(people.size());
+    for (size_t i = 0; i < people.size(); ++i)
+        txs.emplace_back(*people[i], item, static_cast<int>(i % 30));
+    suite.run(string("process/") + name, people.size(), txs.size(), [&] {
+        for (BorrowTransaction& tx : txs) doNotOptimize(tx.process());
+    });
+}
+
+// computeLateFee/<Kind>: N items of one kind
+template <typename T>
+void benchLateFee(BenchSuite& suite, const char* name, const vector<string>& ids) {
+    vector<unique_ptr<LibraryItem>> items;
+    items.reserve(ids.size());
+    for (const string& id : ids) items.push_back(make_unique<T>(id, "Title"));
+    suite.run(string("computeLateFee/") + name, ids.size(), ids.size(), [&] {
+        for (size_t i = 0; i < items.size(); ++i)
+            doNotOptimize(items[i]->computeLateFee(static_cast<int>(i % 30)));
+    });
+}
+
+// computeLateFee/{virtual,variant}_mixed: N items cycling Book/Magazine/DVD,
+// once as heap LibraryItems through the vtable and once as inline ItemVariants;
+// computeLateFees/batch: the same items through the SIMD batch kernel, every
+// other one with a Student discount
+void benchLateFeeMixed(BenchSuite& suite, const vector<string>& ids) {
+    size_t n = ids.size();
+    vector<unique_ptr<LibraryItem>> items;
+    VariantCatalog variants;
+    items.reserve(n);
+    variants.reserve(n, n * 5);
+    for (size_t i = 0; i < n; ++i) {
+        if (i % 3 == 0)      items.push_back(make_unique<Book>(ids[i], "Title"));
+        else if (i % 3 == 1) items.push_back(make_unique<Magazine>(ids[i], "Title"));
+        else                 items.push_back(make_unique<DVD>(ids[i], "Title"));
+        variants.add(*items.back());
+    }
+    vector<int> daysLate(n);
+    for (size_t i = 0; i < n; ++i) daysLate[i] = static_cast<int>(i % 30);
+    vector<Money> fees(n);
+    vector<ItemKind> kinds(n);
+    vector<Discount> discounts(n);
+    for (size_t i = 0; i < n; ++i) {
+        kinds[i] = items[i]->kind();
+        discounts[i] = (i % 2) ? Discount::fromFactor(0.8) : Discount();
+    }
+
+    suite.run("computeLateFee/virtual_mixed", n, n, [&] {
+        for (size_t i = 0; i < n; ++i) fees[i] = items[i]->computeLateFee(daysLate[i]);
+        doNotOptimize(fees.data());
+    });
+    suite.run("computeLateFee/variant_mixed", n, n, [&] {
+        variants.computeLateFees(daysLate.data(), fees.data());
+        doNotOptimize(fees.data());
+    });
+    suite.run("computeLateFees/batch", n, n, [&] {
+        computeLateFees(kinds.data(), daysLate.data(), discounts.data(), fees.data(), n);
+        doNotOptimize(fees.data());
+    });
+    suite.run("typeName/virtual_mixed", n, n, [&] {
+        for (auto& item : items) doNotOptimize(item->typeName().size());
+    });
+    suite.run("typeName/variant_mixed", n, n, [&] {
+        for (size_t i = 0; i < n; ++i) doNotOptimize(typeName(variants[i]).size());
+    });
+}
+
+void runPopulation(BenchSuite& suite, size_t n) {
+    vector<string> userIds = makeIds('U', n);
+    vector<string> itemIds = makeIds('I', n);
+
+    auto students = benchConstruct<Student>(suite, "Student", userIds);
+    auto staff    = benchConstruct<Staff>(suite, "Staff", userIds);
+    auto tas      = benchConstruct<TeachingAssistant>(suite, "TeachingAssistant", userIds);
+
+    // Mixed population for accessor and display cases
+    vector<Person*> mixed;
+    mixed.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        auto& group = (i % 3 == 0) ? students : (i % 3 == 1) ? staff : tas;
+        mixed.push_back(group[i].get());
+    }
+
+    suite.run("id/copy", n, n, [&] {
+        for (Person* p : mixed) doNotOptimize(p->id().size());
+    });
+    suite.run("id/view", n, n, [&] {
+        for (Person* p : mixed) doNotOptimize(p->idView().size());
+    });
+    suite.run("getters/copy", n, n, [&] {
+        for (Person* p : mixed) doNotOptimize(p->getName().size() + p->getEmail().size());
+    });
+    suite.run("discount/dynamic_cast", n, n, [&] {
+        for (Person* p : mixed) doNotOptimize(discountViaDynamicCast(p));
+    });
+    suite.run("discount/role_tag", n, n, [&] {
+        for (Person* p : mixed) doNotOptimize(discountViaRoleTag(p));
+    });
+
+    NullBuffer sink;
+    streambuf* saved = cout.rdbuf(&sink);
+    suite.run("display", n, n, [&] {
+        for (Person* p : mixed) p->display();
+    });
+    cout.rdbuf(saved);
+
+    ReportBuffer report(-1); // invalid fd: flushes are discarded after formatting
+    suite.run("render", n, n, [&] {
+        for (Person* p : mixed) p->render(report);
+        report.flush();
+    });
+
+    benchLateFee<Book>(suite, "Book", itemIds);
+    benchLateFee<Magazine>(suite, "Magazine", itemIds);
+    benchLateFee<DVD>(suite, "DVD", itemIds);
+    benchLateFeeMixed(suite, itemIds);
+
+    Book book("I-bench", "Effective C++");
+    benchProcess(suite, "Student", students, book);
+    benchProcess(suite, "Staff", staff, book);
+    benchProcess(suite, "TeachingAssistant", tas, book);
+}
+
+int runBenchmarks(int argc, char** argv) {
+    size_t minPopulation = 1000;
+    size_t maxPopulation = 1000000;
+    string outPath;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        if (flag == "--min")      minPopulation = strtoull(argv[i + 1], nullptr, 10);
+        else if (flag == "--max") maxPopulation = strtoull(argv[i + 1], nullptr, 10);
+        else if (flag == "--out") outPath = argv[i + 1];
+        else {
+            cerr << "usage: library_bench [--min N] [--max N] [--out results.json]\n";
+            return 2;
+        }
+    }
+    if (minPopulation == 0) minPopulation = 1;
+
+    BenchSuite suite;
+    for (size_t n = minPopulation; n <= maxPopulation; n *= 10)
+        runPopulation(suite, n);
+
+    if (outPath.empty()) {
+        suite.writeJson(cout);
+    } else {
+        ofstream out(outPath);
+        suite.writeJson(out);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) { return runBenchmarks(argc, argv); }
+
+#elif defined(LIBRARY_SELFTEST)
+// ============================================================================
+// SELF-TEST (library_selftest)
+// Built instead of the demo when compiled with -DLIBRARY_SELFTEST:
+//     g++ -std=c++17 -O2 -DLIBRARY_SELFTEST library_system.cpp -o library_selftest
+//     ./library_selftest [seed]
+// Each check runs an optimized path against the plain code it replaces,
+// on random and edge-case inputs, and prints ok/FAIL with the number of
+// mismatches. Build with -std=c++20 to include the ReturnPipeline check.
+// Exit status is the number of failed checks.
+// ============================================================================
+#include <random>
+#include <ctime>
+
+// ============================================================================
+// Class: SelfTest
+// Runs one check at a time; a check returns its number of mismatches.
+// ============================================================================
+class SelfTest {
+public:
+template <typename Fn>
+void run(const string& name, Fn&& check) {
+    size_t mismatches = 0;
+    try {
+        mismatches = check();
+    } catch (const exception& e) {
+        cerr << name << ": " << e.what() << "\n";
+        mismatches = 1;
+    }
+    if (mismatches) ++failed_;
+    cout << (mismatches ? "FAIL " : "ok   ") << name;
+    if (mismatches) cout << " (" << mismatches << " mismatches)";
+    cout << "\n";
+}
+
+int failed() const noexcept { return failed_; }
+
+
+private:
+int failed_ = 0;
+};
+
+// Every late-fee kernel this CPU can run, plus the dispatched entry point
+vector<feekernel::Dispatch> runnableFeeKernels() {
+    vector<feekernel::Dispatch> kernels{{feekernel::scalar, "scalar"}};
+#ifdef LIBRARY_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))  kernels.push_back({feekernel::sse42, "sse4.2"});
+    if (__builtin_cpu_supports("avx2"))    kernels.push_back({feekernel::avx2, "avx2"});
+    if (__builtin_cpu_supports("avx512f")) kernels.push_back({feekernel::avx512, "avx512"});
+#endif
+    kernels.push_back({computeLateFees, "dispatched"});
+    return kernels;
+}
+
+// Batch kernels and VariantCatalog vs virtual computeLateFee + Discount::apply
+size_t checkLateFeeKernels(mt19937& rng, const vector<feekernel::Dispatch>& kernels) {
+    Book book("ST-B", "t");
+    Magazine magazine("ST-M", "t");
+    DVD dvd("ST-D", "t");
+    const LibraryItem* byKind[] = {&book, &magazine, &dvd}; // ItemKind order
+    const int edgeDays[] = {0, 1, -1, 29, INT32_MAX, INT32_MIN, INT32_MAX - 1, INT32_MIN + 1};
+    const uint32_t edgeBp[] = {0, 1, 4999, 5000, 5001, 9999, Discount::kScale};
+
+    size_t n = 1031; // not a multiple of any vector width, so every tail runs
+    vector<ItemKind> kinds(n);
+    vector<int> days(n);
+    vector<Discount> discounts(n);
+    vector<Money> expected(n), undiscounted(n), actual(n);
+    VariantCatalog variants;
+    for (size_t i = 0; i < n; ++i) {
+        kinds[i] = static_cast<ItemKind>(rng() % 3);
+        bool edge = i < 128;
+        days[i] = edge ? edgeDays[i % size(edgeDays)] : int(rng() % 2001) - 1000;
+        discounts[i] = Discount::fromBasisPoints(edge ? edgeBp[i / size(edgeDays) % size(edgeBp)]
+                                                      : rng() % (Discount::kScale + 1));
+        undiscounted[i] = byKind[size_t(kinds[i])]->computeLateFee(days[i]);
+        expected[i] = discounts[i].apply(undiscounted[i]);
+        variants.add(*byKind[size_t(kinds[i])]);
+    }
+
+    size_t mismatches = 0;
+    for (const feekernel::Dispatch& kernel : kernels) {
+        for (size_t offset : {size_t(0), size_t(1), size_t(3)}) { // unaligned starts
+            fill(actual.begin(), actual.end(), Money::fromCents(-12345));
+            kernel.fn(kinds.data() + offset, days.data() + offset, discounts.data() + offset,
+                      actual.data() + offset, n - offset);
+            for (size_t i = offset; i < n; ++i) mismatches += actual[i] != expected[i];
+        }
+    }
+    variants.computeLateFees(days.data(), actual.data());
+    for (size_t i = 0; i < n; ++i) mismatches += actual[i] != undiscounted[i];
+    return mismatches;
+}
+
+// DueDateWheel vs the day each timer should fire: its fire day, or the next
+// advance if it was already due when scheduled
+size_t checkDueDateWheel(mt19937& rng) {
+    LibraryDay today = -50;
+    DueDateWheel wheel(today);
+    vector<LibraryDay> scheduledOn; // indexed by timer key
+    size_t mismatches = 0, pending = 0;
+    auto onFire = [&](const DueDateWheel::Timer& timer) {
+        if (wheel.today() != max(timer.fireDay, scheduledOn[timer.key])) ++mismatches;
+        --pending;
+    };
+    for (int step = 0; step < 20000; ++step) {
+        for (unsigned k = rng() % 4; k > 0; --k) {
+            LibraryDay fireDay = today + LibraryDay(rng() % 1200) - 3; // past, near and overflow
+            scheduledOn.push_back(today);
+            wheel.schedule({uint32_t(scheduledOn.size() - 1), 0, fireDay});
+            ++pending;
+        }
+        LibraryDay days = 1 + LibraryDay(rng() % 4);
+        wheel.advance(days, onFire);
+        today += days;
+    }
+    wheel.advance(1200, onFire);
+    return mismatches + pending; // every timer must have fired exactly once
+}
+
+// CirculationDesk/AccrualEngine pending fees vs recomputing every open loan
+size_t checkAccrual(mt19937& rng) {
+    vector<unique_ptr<Person>> people;
+    vector<unique_ptr<LibraryItem>> items;
+    for (int i = 0; i < 20; ++i) {
+        string id = "ST-U" + to_string(i);
+        if (i % 3 == 0)      people.push_back(make_unique<Student>(id, "n", "e", 1e6, 50, 0.85));
+        else if (i % 3 == 1) people.push_back(make_unique<Staff>(id, "n", "e", 1e6));
+        else                 people.push_back(make_unique<TeachingAssistant>(id, "n", "e", 1e6, 50, 0.33, true));
+    }
+    for (int i = 0; i < 200; ++i) {
+        string id = "ST-I" + to_string(i);
+        if (i % 3 == 0)      items.push_back(make_unique<Book>(id, "t"));
+        else if (i % 3 == 1) items.push_back(make_unique<Magazine>(id, "t"));
+        else                 items.push_back(make_unique<DVD>(id, "t"));
+    }
+
+    CirculationDesk desk(0, 10);
+    size_t mismatches = 0;
+    for (int step = 0; step < 400; ++step) {
+        for (int k = 0; k < 5; ++k) {
+            Person& person = *people[rng() % people.size()];
+            LibraryItem& item = *items[rng() % items.size()];
+            if (rng() % 2) {
+                desk.borrow(person, item);
+                continue;
+            }
+            for (auto& holder : people)
+                if (holder->idHandle() == desk.loans().holder(item)) desk.returnItem(*holder, item);
+        }
+        desk.advanceDay(1 + LibraryDay(rng() % 3));
+
+        for (auto& person : people) {
+            Money expected;
+            for (auto& item : items) {
+                if (desk.loans().holder(*item) != person->idHandle()) continue;
+                LibraryDay late = desk.today() - *desk.dueDay(*item);
+                if (late <= 0) continue;
+                Money fee = item->computeLateFee(late);
+                expected += person->hasRole(RoleStudent) ? person->feeDiscount().apply(fee) : fee;
+            }
+            mismatches += expected != desk.pendingFees(*person);
+        }
+    }
+    return mismatches;
+}
+
+// intersectSorted vs std::set_intersection over sparse and dense inputs
+size_t checkIntersectSorted(mt19937& rng) {
+    size_t mismatches = 0;
+    for (int trial = 0; trial < 2000; ++trial) {
+        uint32_t range = 1 + rng() % (trial % 2 ? 64 : 100000);
+        auto randomSet = [&] {
+            vector<uint32_t> values(rng() % 200);
+            for (uint32_t& v : values) v = rng() % range;
+            sort(values.begin(), values.end());
+            values.erase(unique(values.begin(), values.end()), values.end());
+            return values;
+        };
+        vector<uint32_t> a = randomSet(), b = randomSet(), expected;
+        set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(expected));
+        vector<uint32_t> actual(min(a.size(), b.size()));
+        actual.resize(intersectSorted(a.data(), a.size(), b.data(), b.size(), actual.data()));
+        mismatches += actual != expected;
+    }
+    return mismatches;
+}
+
+// Borrowers and returns shared by the batch and executor checks: one set of
+// users per run, the same (user, item, days late) sequence for each
+struct FeeScenario {
+    vector<tuple<size_t, size_t, int>> returns;
+
+    static vector<unique_ptr<Person>> users(size_t count) {
+        vector<unique_ptr<Person>> people;
+        for (size_t i = 0; i < count; ++i) {
+            string id = "ST-F" + to_string(i);
+            if (i % 2) people.push_back(make_unique<Student>(id, "n", "e", double(i % 50), 2, 0.8));
+            else       people.push_back(make_unique<Staff>(id, "n", "e", double(i % 40)));
+        }
+        return people;
+    }
+
+    vector<BorrowTransaction> transactions(vector<unique_ptr<Person>>& people,
+                                           LibraryItem* const* items) const {
+        vector<BorrowTransaction> txs;
+        txs.reserve(returns.size());
+        for (auto [user, item, daysLate] : returns) txs.emplace_back(*people[user], *items[item], daysLate);
+        return txs;
+    }
+};
+
+// Balances and fees after `apply` vs processing every transaction in order
+template <typename Apply>
+size_t checkAgainstSerial(const FeeScenario& scenario, size_t userCount, Apply&& apply) {
+    Book book("ST-FB", "t");
+    DVD dvd("ST-FD", "t");
+    LibraryItem* items[] = {&book, &dvd};
+
+    vector<unique_ptr<Person>> serialUsers = FeeScenario::users(userCount);
+    vector<unique_ptr<Person>> testedUsers = FeeScenario::users(userCount);
+    vector<BorrowTransaction> serial = scenario.transactions(serialUsers, items);
+    vector<BorrowTransaction> tested = scenario.transactions(testedUsers, items);
+
+    Money expected;
+    for (BorrowTransaction& tx : serial) expected += tx.process();
+    size_t mismatches = apply(tested) != expected;
+    for (size_t i = 0; i < userCount; ++i)
+        mismatches += serialUsers[i]->getBalance() != testedUsers[i]->getBalance();
+    for (size_t i = 0; i < serial.size(); ++i)
+        mismatches += serial[i].getLateFeeCost() != tested[i].getLateFeeCost();
+    return mismatches;
+}
+
+// TransactionBatch (including negative-fee credits) vs serial processing
+size_t checkTransactionBatch(mt19937& rng) {
+    size_t mismatches = 0;
+    for (int trial = 0; trial < 200; ++trial) {
+        FeeScenario scenario;
+        for (int k = 0; k < 200; ++k)
+            scenario.returns.emplace_back(rng() % 20, rng() % 2, int(rng() % 40) - 10);
+        mismatches += checkAgainstSerial(scenario, 20, [](vector<BorrowTransaction>& txs) {
+            TransactionBatch batch;
+            return batch.processAll(txs);
+        });
+    }
+    return mismatches;
+}
+
+// TransactionExecutor at several worker counts vs serial processing
+size_t checkTransactionExecutor(mt19937& rng) {
+    FeeScenario scenario;
+    for (int k = 0; k < 50000; ++k)
+        scenario.returns.emplace_back(rng() % 500, rng() % 2, int(rng() % 30));
+    size_t mismatches = 0;
+    for (unsigned workers : {1u, 2u, 4u}) {
+        mismatches += checkAgainstSerial(scenario, 500, [workers](vector<BorrowTransaction>& txs) {
+            TransactionExecutor executor(workers);
+            for (size_t i = 0; i < txs.size(); i += 4096)
+                executor.submit(txs.data() + i, min<size_t>(4096, txs.size() - i));
+            return executor.drain();
+        });
+    }
+    return mismatches;
+}
+
+// Scratch file under /tmp, unique to this process
+string scratchPath(const string& name) {
+    return "/tmp/library_selftest_" + to_string(getpid()) + "_" + name;
+}
+
+// TransactionLog across reopens: LSNs continue, a torn tail left by a crash
+// is cut off so records written after it stay readable, and over-long IDs
+// are rejected instead of truncated
+size_t checkTransactionLogRecovery(mt19937& rng) {
+    string path = scratchPath("wal.log");
+    ::unlink(path.c_str());
+    vector<FeeEvent> expected;
+    size_t mismatches = 0;
+    auto logSome = [&](TransactionLog& log, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            FeeEvent event;
+            event.userId = "U" + to_string(rng() % 100);
+            event.itemId = "I" + to_string(rng() % 100);
+            event.daysLate = int32_t(rng() % 30);
+            event.fee = Money::fromCents(rng() % 5000);
+            event.balanceAfter = Money::fromCents(rng() % 100000);
+            mismatches += log.append(event) != expected.size() + 1;
+            expected.push_back(move(event));
+        }
+        log.sync();
+    };
+
+    {
+        TransactionLog log(path);
+        logSome(log, 5);
+    }
+    {
+        // A crash mid-write: a header promising 48 payload bytes, then 5 of them
+        const char torn[13] = {48, 0, 0, 0, 1, 2, 3, 4, 'S', '1', '0', '0', 'X'};
+        ofstream out(path, ios::binary | ios::app);
+        out.write(torn, sizeof(torn));
+    }
+    for (int reopen = 0; reopen < 2; ++reopen) { // after the tear, then a clean reopen
+        TransactionLog log(path);
+        mismatches += log.durableLsn() != expected.size();
+        logSome(log, 5);
+    }
+    {
+        TransactionLog log(path);
+        FeeEvent oversized;
+        oversized.userId.assign(TransactionLog::kMaxIdLength + 1, 'U');
+        oversized.itemId = "I1";
+        try {
+            log.append(oversized);
+            ++mismatches;
+        } catch (const length_error&) {
+        }
+    }
+
+    vector<FeeEvent> replayed = TransactionLog::readAll(path);
+    mismatches += replayed.size() != expected.size();
+    for (size_t i = 0; i < min(replayed.size(), expected.size()); ++i) {
+        const FeeEvent &a = replayed[i], &b = expected[i];
+        mismatches += a.userId != b.userId || a.itemId != b.itemId || a.daysLate != b.daysLate ||
+                      a.fee != b.fee || a.balanceAfter != b.balanceAfter;
+    }
+    ::unlink(path.c_str());
+    return mismatches;
+}
+
+// writeSnapshot + Snapshot: every field the classes expose comes back,
+// including unlimited (non-Student) borrow limits; a truncated file is refused
+size_t checkSnapshotRoundTrip(mt19937& rng) {
+    UserDirectory users;
+    Catalog items;
+    for (int i = 0; i < 500; ++i) {
+        string id = "ST-S" + to_string(i), name = "Name " + to_string(rng()), email = to_string(i) + "@uni.edu";
+        double balance = double(rng() % 1000000) / 100;
+        double discount = double(rng() % 10001) / 10000;
+        int limit = int(rng() % 6);
+        if (i % 4 == 0)      users.add(make_unique<Student>(id, name, email, balance, limit, discount));
+        else if (i % 4 == 1) users.add(make_unique<Staff>(id, name, email, balance, rng() % 2 == 0));
+        else if (i % 4 == 2) users.add(make_unique<TeachingAssistant>(id, name, email, balance, limit, discount, rng() % 2 == 0));
+        else                 users.add(make_unique<Person>(id, name, email, balance));
+        string item = "ST-T" + to_string(i), title = "Title " + to_string(rng());
+        if (i % 3 == 0)      items.add(make_unique<Book>(item, title));
+        else if (i % 3 == 1) items.add(make_unique<Magazine>(item, title));
+        else                 items.add(make_unique<DVD>(item, title));
+    }
+
+    string path = scratchPath("snapshot.bin");
+    writeSnapshot(path, users, items);
+    size_t mismatches = 0;
+    {
+        Snapshot snap(path);
+        mismatches += snap.userCount() != users.size() || snap.itemCount() != items.size();
+        for (size_t i = 0; i < min(snap.userCount(), users.size()); ++i) {
+            Snapshot::UserView view = snap.user(i);
+            const Person& person = users[i];
+            mismatches += view.id() != person.idView() || view.name() != person.getName() ||
+                          view.email() != person.getEmail() || view.roles() != person.roles() ||
+                          view.discount().basisPoints() != person.feeDiscount().basisPoints() ||
+                          view.borrowLimit() != person.borrowLimit() ||
+                          view.canApprovePurchases() != person.hasPurchaseApproval() ||
+                          view.balance() != person.getBalance();
+        }
+        for (size_t i = 0; i < min(snap.itemCount(), items.size()); ++i) {
+            Snapshot::ItemView view = snap.item(i);
+            const LibraryItem& item = items[i];
+            mismatches += view.id() != item.idView() || view.getTitle() != item.getTitle() ||
+                          view.kind() != item.kind() || view.lateFeePerDay() != item.lateFeePerDay();
+        }
+    }
+    if (truncate(path.c_str(), 1000) != 0) ++mismatches;
+    try {
+        Snapshot truncated(path);
+        ++mismatches;
+    } catch (const runtime_error&) {
+    }
+    ::unlink(path.c_str());
+    return mismatches;
+}
+
+// One reply frame as a client sees it
+struct Reply {
+    uint32_t tag;
+    wire::Status status;
+    string body;
+};
+
+// Read `count` replies from `fd` (fewer if the server closes first)
+vector<Reply> readReplies(int fd, size_t count) {
+    vector<Reply> replies;
+    string buffer;
+    size_t consumed = 0;
+    char chunk[64 * 1024];
+    while (replies.size() < count) {
+        if (auto frame = wire::parseFrame(string_view(buffer).substr(consumed))) {
+            replies.push_back({frame->tag, wire::Status(frame->code), string(frame->body)});
+            consumed += frame->size;
+            continue;
+        }
+        ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n <= 0) break;
+        buffer.append(chunk, size_t(n));
+    }
+    return replies;
+}
+
+int connectTo(const string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool sendAll(int fd, string_view bytes) {
+    while (!bytes.empty()) {
+        ssize_t n = ::send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes.remove_prefix(size_t(n));
+    }
+    return true;
+}
+
+// LibraryServer over a real socket: it leaves a non-socket file at its path
+// alone, replaces a stale socket, answers pipelined requests in order, and
+// after a client half-closes with replies still queued it delivers them all
+// without spinning on the hang-up event
+size_t checkServer(mt19937& rng) {
+    string path = scratchPath("server.sock");
+    string user = "SV" + to_string(rng()) + "-U", item = "SV" + to_string(rng()) + "-I";
+    UserDirectory users;
+    Catalog items;
+    users.add(make_unique<Student>(user, "Sam", "sam@uni.edu", 50.0, 2, 0.8));
+    items.add(make_unique<Book>(item, "Title"));
+    CirculationDesk desk(IdTable::global().size());
+    size_t mismatches = 0;
+
+    ::unlink(path.c_str());
+    ofstream(path) << "not a socket";
+    try {
+        LibraryServer refused(path, users, items, desk);
+        ++mismatches;
+    } catch (const runtime_error&) {
+    }
+    struct stat info;
+    mismatches += lstat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode);
+    ::unlink(path.c_str());
+    { // a socket file left by a server that died without cleaning up
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        mismatches += bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0;
+        ::close(fd);
+    }
+
+    LibraryServer server(path, users, items, desk);
+    thread serving([&] { server.run(); });
+
+    using wire::Op;
+    using wire::Status;
+    string requests;
+    auto request = [&](uint32_t tag, Op op, string_view who) {
+        return wire::FrameWriter(requests, tag, uint8_t(op)).putString(who);
+    };
+    { auto frame = request(1, Op::LookupUser, user); frame.finish(); }
+    { auto frame = request(2, Op::AddFunds, user); frame.put(int64_t(250)).finish(); }
+    { auto frame = request(3, Op::Borrow, user); frame.putString(item).finish(); }
+    { auto frame = request(4, Op::Borrow, user); frame.putString(item).finish(); }
+    { auto frame = request(5, Op::Return, user); frame.putString(item).finish(); }
+    { auto frame = request(6, Op::Return, user); frame.putString(item).finish(); }
+    { auto frame = request(7, Op::Balance, "nobody"); frame.finish(); }
+    { auto frame = request(8, Op::AddFunds, user); frame.put(int64_t(-5)).finish(); }
+    const Status expected[] = {Status::Ok, Status::Ok, Status::Ok, Status::ItemUnavailable,
+                               Status::Ok, Status::NotBorrowed, Status::UnknownUser, Status::BadRequest};
+
+    int client = connectTo(path);
+    mismatches += client < 0 || !sendAll(client, requests);
+    vector<Reply> replies = readReplies(client, size(expected));
+    mismatches += replies.size() != size(expected);
+    for (size_t i = 0; i < min(replies.size(), size(expected)); ++i)
+        mismatches += replies[i].tag != i + 1 || replies[i].status != expected[i];
+    if (replies.size() == size(expected)) {
+        wire::FrameReader lookup(replies[0].body);
+        mismatches += lookup.getString() != "Sam" || lookup.getString() != "sam@uni.edu" ||
+                      lookup.get<int64_t>() != 5000;
+        wire::FrameReader funds(replies[1].body);
+        mismatches += funds.get<int64_t>() != 5250;
+    }
+
+    // Queue more replies than the socket buffers hold, then half-close
+    constexpr size_t kQueued = 40000;
+    requests.clear();
+    for (uint32_t tag = 0; tag < kQueued; ++tag) {
+        auto frame = request(tag, Op::Balance, user);
+        frame.finish();
+    }
+    mismatches += !sendAll(client, requests);
+    shutdown(client, SHUT_WR);
+    clock_t before = clock();
+    this_thread::sleep_for(chrono::milliseconds(300));
+    double busySeconds = double(clock() - before) / CLOCKS_PER_SEC;
+    mismatches += busySeconds > 0.1;
+
+    replies = readReplies(client, kQueued + 1); // the server closes after the last one
+    mismatches += replies.size() != kQueued;
+    for (size_t i = 0; i < min(replies.size(), kQueued); ++i)
+        mismatches += replies[i].tag != i || replies[i].status != Status::Ok;
+    ::close(client);
+
+    server.stop();
+    serving.join();
+    mismatches += server.stats().connections != 1 || server.stats().requests != size(expected) + kQueued;
+    return mismatches;
+}
+
+// render() vs display(): every user type and a spread of balances and
+// discounts, including ones %g prints in exponent form, give the same bytes
+size_t checkRenderParity(mt19937& rng) {
+    vector<unique_ptr<Person>> people;
+    for (int i = 0; i < 2000; ++i) {
+        string id = "RD" + to_string(i), name = "Name " + to_string(rng() % 1000);
+        int64_t scale = int64_t(1) << (rng() % 50);
+        double balance = double(int64_t(rng()) % scale) / 100;
+        double discount = double(rng() % 10001) / 10000;
+        int limit = int(rng() % 100);
+        switch (i % 4) {
+        case 0:  people.push_back(make_unique<Student>(id, name, "s@x", balance, limit, discount)); break;
+        case 1:  people.push_back(make_unique<Staff>(id, name, "f@x", balance, rng() % 2 == 0)); break;
+        case 2:  people.push_back(make_unique<TeachingAssistant>(id, name, "t@x", balance, limit, discount, rng() % 2 == 0)); break;
+        default: people.push_back(make_unique<Person>(id, name, "p@x", balance)); break;
+        }
+    }
+
+    ostringstream displayed;
+    streambuf* saved = cout.rdbuf(displayed.rdbuf());
+    for (const auto& person : people) person->display();
+    cout.rdbuf(saved);
+
+    ReportBuffer rendered(-1, 1 << 20);
+    for (const auto& person : people) person->render(rendered);
+    size_t mismatches = rendered.pending() != displayed.str();
+
+    // Raw doubles around the %g switch points
+    for (double value : {0.0, -0.0, 1e-5, 0.0001, 0.1235, 123456.0, 999999.5, 1234567.0, -2.5e-7, 1e21}) {
+        ostringstream stream;
+        stream << value;
+        rendered.clear();
+        rendered.append(value);
+        mismatches += rendered.pending() != stream.str();
+    }
+    rendered.clear();
+    return mismatches;
+}
+
+// LoanIndex under concurrent borrow/release of shared users and items:
+// no item is ever lent twice, no user goes past borrowLimit(), and once
+// everything is returned every counter and holder slot is back to zero
+size_t checkLoanIndexRaces(mt19937& rng) {
+    constexpr size_t kUsers = 40, kItems = 200, kThreads = 4, kOps = 20000;
+    string run = to_string(rng());
+    vector<unique_ptr<Person>> users;
+    vector<unique_ptr<LibraryItem>> items;
+    for (size_t u = 0; u < kUsers; ++u) {
+        string id = "LR" + run + "-U" + to_string(u);
+        if (u % 4 == 0) users.push_back(make_unique<Staff>(id, "n", "e", 0.0, false));
+        else            users.push_back(make_unique<Student>(id, "n", "e", 0.0, int(u % 3) + 1, 0.8));
+    }
+    for (size_t i = 0; i < kItems; ++i)
+        items.push_back(make_unique<Book>("LR" + run + "-I" + to_string(i), "t"));
+
+    LoanIndex index; // no pre-allocation, so chunks are installed concurrently too
+    vector<atomic<uint32_t>> lent(kItems);    // item -> 1 + user while lent
+    vector<atomic<uint32_t>> counted(kUsers); // loans a user holds as seen by the threads
+    atomic<size_t> violations{0};
+    vector<vector<pair<size_t, size_t>>> held(kThreads);
+
+    auto worker = [&](unsigned t, uint32_t seed) {
+        mt19937 local(seed);
+        for (size_t op = 0; op < kOps; ++op) {
+            if (!held[t].empty() && local() % 2 == 0) {
+                size_t pick = local() % held[t].size();
+                auto [u, i] = held[t][pick];
+                held[t][pick] = held[t].back();
+                held[t].pop_back();
+                uint32_t mine = uint32_t(u + 1);
+                if (!lent[i].compare_exchange_strong(mine, 0)) violations.fetch_add(1);
+                counted[u].fetch_sub(1);
+                if (!index.release(*users[u], *items[i])) violations.fetch_add(1);
+            } else {
+                size_t u = local() % kUsers, i = local() % kItems;
+                if (index.borrow(*users[u], *items[i]) != BorrowStatus::Ok) continue;
+                uint32_t none = 0;
+                if (!lent[i].compare_exchange_strong(none, uint32_t(u + 1))) violations.fetch_add(1);
+                if (counted[u].fetch_add(1) + 1 > users[u]->borrowLimit()) violations.fetch_add(1);
+                held[t].emplace_back(u, i);
+            }
+        }
+    };
+    vector<thread> threads;
+    for (unsigned t = 0; t < kThreads; ++t) threads.emplace_back(worker, t, uint32_t(rng()));
+    for (thread& running : threads) running.join();
+
+    size_t mismatches = violations.load();
+    for (size_t u = 0; u < kUsers; ++u)
+        mismatches += index.activeLoans(*users[u]) != counted[u].load();
+    for (size_t i = 0; i < kItems; ++i) {
+        uint32_t holder = lent[i].load();
+        mismatches += holder ? index.holder(*items[i]) != users[holder - 1]->idHandle()
+                             : index.holder(*items[i]).valid();
+    }
+    for (auto& loans : held)
+        for (auto [u, i] : loans) {
+            mismatches += !index.release(*users[u], *items[i]);
+            mismatches += index.release(*users[u], *items[i]); // already returned
+        }
+    for (size_t u = 0; u < kUsers; ++u) mismatches += index.activeLoans(*users[u]) != 0;
+    for (size_t i = 0; i < kItems; ++i) mismatches += index.holder(*items[i]).valid();
+    return mismatches;
+}
+
+// BulkImporter at several thread counts: accepted rows keep file order and
+// every rejected row reports its 1-based line number across chunk seams,
+// with blank lines, CRLF endings, quoted fields and a header in the mix
+size_t checkImporterLines(mt19937& rng) {
+    string csv = "id,name,email,role,balance,maxConcurrentBorrows,discountFactor,canApprovePurchases\n";
+    vector<pair<string, string>> accepted; // id, name
+    vector<size_t> rejectedLines;
+    const char* badRows[] = {
+        ",name,e,Student,1,2,0.5,0",          // empty id
+        "X,name,e,Student,abc,2,0.5,0",       // bad balance
+        "X,name,e,Student,1,-1,0.5,0",        // negative borrows
+        "X,name,e,Student,1,2,1.5,0",         // discount out of range
+        "X,name,e,Janitor,1,2,0.5,0",         // unknown role
+        "X,name,e,Staff,1,,,maybe",           // bad bool
+        "X,\"unterminated,e,Staff,1,,,0",     // quoting
+        "X,name,e,Staff",                     // too few fields
+    };
+    for (size_t line = 2; line <= 3000; ++line) {
+        unsigned pick = rng() % 10;
+        string ending = rng() % 4 == 0 ? "\r\n" : "\n";
+        if (pick == 0) {
+            csv += ending; // blank
+        } else if (pick == 1) {
+            csv += string(badRows[rng() % size(badRows)]) + ending;
+            rejectedLines.push_back(line);
+        } else {
+            string id = "IL" + to_string(line);
+            if (pick == 2) {
+                csv += id + ",\"Doe, \"\"J\"\"\",j@x,Staff,10,,,1" + ending;
+                accepted.emplace_back(id, "Doe, \"J\"");
+            } else {
+                csv += id + ",Name" + to_string(line) + ",n@x,Student,1.5,3,0.75,0" + ending;
+                accepted.emplace_back(id, "Name" + to_string(line));
+            }
+        }
+    }
+    csv += "X,no,newline,Student,1,2,7,0"; // last line, rejected
+    rejectedLines.push_back(3001);
+
+    size_t mismatches = 0;
+    for (unsigned threads : {1u, 2u, 3u, 7u, 64u}) {
+        BulkImporter::Result<Person> result = BulkImporter::importUsers(csv, threads);
+        mismatches += result.records.size() != accepted.size() || result.rejected.size() != rejectedLines.size();
+        for (size_t i = 0; i < min(result.records.size(), accepted.size()); ++i)
+            mismatches += result.records[i]->idView() != accepted[i].first ||
+                          result.records[i]->getName() != accepted[i].second;
+        for (size_t i = 0; i < min(result.rejected.size(), rejectedLines.size()); ++i)
+            mismatches += result.rejected[i].line != rejectedLines[i];
+    }
+    return mismatches;
+}
+
+// Restart from a snapshot taken mid-log: replaying from its logLsn() lands on
+// the live balances, and the events before it are not charged again
+size_t checkSnapshotReplay(mt19937& rng) {
+    string snapPath = scratchPath("replay.snap"), logPath = scratchPath("replay.log");
+    ::unlink(logPath.c_str());
+    UserDirectory live;
+    Catalog items;
+    for (int i = 0; i < 50; ++i)
+        live.add(make_unique<Person>("RP-U" + to_string(i), "Name", "mail", double(rng() % 100000) / 100));
+
+    size_t mismatches = 0;
+    {
+        TransactionLog log(logPath);
+        auto charge = [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                Person& person = live[rng() % live.size()];
+                FeeEvent event;
+                event.userId = string(person.idView());
+                event.itemId = "RP-I";
+                event.daysLate = 1;
+                event.fee = Money::fromCents(rng() % 2000);
+                person.deduct(event.fee);
+                event.balanceAfter = person.getBalance();
+                log.append(event);
+            }
+            log.sync();
+        };
+        charge(300);
+        writeSnapshot(snapPath, live, items, log.durableLsn());
+        charge(300);
+    }
+
+    auto restore = [&](UserDirectory& users, const Snapshot& snap) {
+        for (size_t i = 0; i < snap.userCount(); ++i) {
+            Snapshot::UserView view = snap.user(i);
+            users.add(make_unique<Person>(view.id(), view.name(), view.email(), view.balance().toDouble()));
+        }
+    };
+    Snapshot snap(snapPath);
+    mismatches += snap.logLsn() != 300;
+
+    UserDirectory restored;
+    restore(restored, snap);
+    LogReplayer::Report report =
+        LogReplayer::replay(logPath, restored, 2, balanceChecksum(live), snap.logLsn());
+    mismatches += report.events != 300 || report.skipped != 300 || report.balanceMismatches != 0 ||
+                  !report.checksumVerified;
+
+    // Without the LSN the first 300 events are charged twice
+    UserDirectory doubled;
+    restore(doubled, snap);
+    mismatches += LogReplayer::replay(logPath, doubled, 2, balanceChecksum(live)).checksumVerified;
+
+    try {
+        UserDirectory ahead;
+        LogReplayer::replay(logPath, ahead, 2, nullopt, 601);
+        ++mismatches;
+    } catch (const runtime_error&) {
+    }
+    ::unlink(snapPath.c_str());
+    ::unlink(logPath.c_str());
+    return mismatches;
+}
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+// ReturnPipeline vs parsing and processing the same lines one at a time
+size_t checkReturnPipeline(mt19937& rng) {
+    auto build = [](UserDirectory& users, Catalog& items) {
+        for (int i = 0; i < 300; ++i) {
+            string user = "ST-P" + to_string(i), item = "ST-Q" + to_string(i);
+            if (i % 3 == 0)      users.add(make_unique<Student>(user, "n", "e", 80.0, 2, 0.8));
+            else if (i % 3 == 1) users.add(make_unique<Staff>(user, "n", "e", 60.0, true));
+            else                 users.add(make_unique<TeachingAssistant>(user, "n", "e", 70.0, 2, 0.85, true));
+            if (i % 3 == 0)      items.add(make_unique<Book>(item, "t"));
+            else if (i % 3 == 1) items.add(make_unique<Magazine>(item, "t"));
+            else                 items.add(make_unique<DVD>(item, "t"));
+        }
+    };
+    UserDirectory serialUsers, pipelineUsers;
+    Catalog serialItems, pipelineItems;
+    build(serialUsers, serialItems);
+    build(pipelineUsers, pipelineItems);
+
+    vector<string> lines;
+    for (int i = 0; i < 20000; ++i) {
+        lines.push_back("ST-P" + to_string(rng() % 300) + ",ST-Q" + to_string(rng() % 300) + "," +
+                        to_string(rng() % 20));
+        if (i % 1000 == 0) lines.push_back("malformed line");
+        if (i % 1000 == 1) lines.push_back("ST-P1,unknown,3");
+    }
+
+    Money expected;
+    vector<Money> fees;
+    for (const string& line : lines) {
+        size_t a = line.find(','), b = line.find(',', a + 1);
+        if (b == string::npos) continue;
+        Person* person = serialUsers.find(string_view(line).substr(0, a));
+        LibraryItem* item = serialItems.find(string_view(line).substr(a + 1, b - a - 1));
+        if (!person || !item) continue;
+        BorrowTransaction tx(*person, *item, stoi(line.substr(b + 1)));
+        expected += tx.process();
+        fees.push_back(tx.getLateFeeCost());
+    }
+
+    vector<FeeEvent> persisted;
+    ReturnPipeline pipeline(pipelineUsers, pipelineItems,
+                            [&](const FeeEvent& event) { persisted.push_back(event); }, 64, 256);
+    ReturnPipeline::Report report = pipeline.run(lines);
+
+    size_t mismatches = (report.charged != expected) + (persisted.size() != fees.size());
+    mismatches += report.unpersisted != 0 || !report.persistError.empty();
+    for (size_t i = 0; i < min(fees.size(), persisted.size()); ++i) mismatches += persisted[i].fee != fees[i];
+    for (size_t i = 0; i < serialUsers.size(); ++i)
+        mismatches += serialUsers[i].getBalance() != pipelineUsers[i].getBalance();
+
+    // A persist failure (e.g. a poisoned TransactionLog) must stop the run,
+    // not terminate: the records charged are a prefix of the serial ones
+    UserDirectory failingUsers;
+    Catalog failingItems;
+    build(failingUsers, failingItems);
+    size_t persistedBeforeFailure = 0, failAfter = 1000 + rng() % 5000;
+    ReturnPipeline failing(failingUsers, failingItems, [&](const FeeEvent&) {
+        if (persistedBeforeFailure == failAfter) throw runtime_error("disk full");
+        ++persistedBeforeFailure;
+    }, 64, 256);
+    ReturnPipeline::Report failed = failing.run(lines);
+    size_t charges = failed.stages[5].items + failed.unpersisted;
+    Money chargedPrefix;
+    for (size_t i = 0; i < min(charges, fees.size()); ++i) chargedPrefix += fees[i];
+    mismatches += failed.persistError != "disk full" || failed.stages[5].items != failAfter;
+    mismatches += charges < failAfter + 1 || charges >= fees.size() || failed.charged != chargedPrefix;
+    return mismatches;
+}
+#endif
+
+int main(int argc, char** argv) {
+    uint32_t seed = argc > 1 ? uint32_t(strtoul(argv[1], nullptr, 10)) : 1;
+    mt19937 rng(seed);
+    cout << "seed " << seed << "\n";
+
+    vector<feekernel::Dispatch> kernels = runnableFeeKernels();
+    string kernelNames;
+    for (const feekernel::Dispatch& kernel : kernels)
+        kernelNames += (kernelNames.empty() ? "" : ", ") + string(kernel.name);
+
+    SelfTest test;
+    test.run("computeLateFees kernels (" + kernelNames + ")", [&] { return checkLateFeeKernels(rng, kernels); });
+    test.run("DueDateWheel vs fire days", [&] { return checkDueDateWheel(rng); });
+    test.run("AccrualEngine vs recomputed fees", [&] { return checkAccrual(rng); });
+    test.run("intersectSorted vs set_intersection", [&] { return checkIntersectSorted(rng); });
+    test.run("TransactionBatch vs serial", [&] { return checkTransactionBatch(rng); });
+    test.run("TransactionExecutor vs serial", [&] { return checkTransactionExecutor(rng); });
+    test.run("TransactionLog reopen after a torn tail", [&] { return checkTransactionLogRecovery(rng); });
+    test.run("snapshot round trip", [&] { return checkSnapshotRoundTrip(rng); });
+    test.run("log replay from a snapshot", [&] { return checkSnapshotReplay(rng); });
+    test.run("BulkImporter line numbers", [&] { return checkImporterLines(rng); });
+    test.run("LoanIndex concurrent borrow/release", [&] { return checkLoanIndexRaces(rng); });
+    test.run("render vs display bytes", [&] { return checkRenderParity(rng); });
+    test.run("LibraryServer socket round trip", [&] { return checkServer(rng); });
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+    test.run("ReturnPipeline vs serial", [&] { return checkReturnPipeline(rng); });
+#else
+    cout << "skip ReturnPipeline vs serial (needs -std=c++20)\n";
+#endif
+    return test.failed();
+}
+
+#else
+// ============================================================================
+// MAIN PROGRAM
+// Demonstrates:
+// - Polymorphic user display
+// - Fund management
+// - Borrowing and fee deduction
+// - Lookup of users and items by ID
+// - Optional request server: library_system --serve <socket path>
+// ============================================================================
+static LibraryServer* runningServer = nullptr;
+
+// Serve the demo users and items over `socketPath` until SIGINT/SIGTERM
+int serveDemo(const char* socketPath) {
+    UserDirectory users;
+    users.add(make_unique<Student>("S100","Amina","amina@uni.edu",50.0,2,0.8));
+    users.add(make_unique<Staff>("ST200","Omar","omar@uni.edu",75.0,true));
+    users.add(make_unique<TeachingAssistant>("TA300","Lina","lina@uni.edu",60.0,2,0.85,true));
+
+    Catalog items;
+    items.add(make_unique<Book>("B001","Effective C++"));
+    items.add(make_unique<Magazine>("M010","Tech Monthly"));
+    items.add(make_unique<DVD>("D100","C++ Patterns"));
+
+    CirculationDesk desk(IdTable::global().size());
+    LibraryServer server(socketPath, users, items, desk);
+    runningServer = &server;
+    signal(SIGINT,  [](int) { runningServer->stop(); });
+    signal(SIGTERM, [](int) { runningServer->stop(); });
+
+    cerr << "serving on " << server.path() << "\n";
+    server.run();
+    runningServer = nullptr;
+    cerr << "served " << server.stats().requests << " requests on "
+         << server.stats().connections << " connections\n";
+    return 0;
+}
+
+int main(int argc, char** argv) {
+if (argc == 3 && string_view(argv[1]) == "--serve") return serveDemo(argv[2]);
+
+
+// ------------------------------------------------------------
+// 1. Create Users (stored polymorphically as Person*)
+// ------------------------------------------------------------
+UserDirectory users;
+users.add(make_unique<Student>("S100","Amina","amina@uni.edu",50.0,2,0.8));
+users.add(make_unique<Staff>("ST200","Omar","omar@uni.edu",75.0,true));
+users.add(make_unique<TeachingAssistant>("TA300","Lina","lina@uni.edu",60.0,2,0.85,true));
+
+cout << "=== Users ===\n";
+for (const auto& u : users)
+    u->display();
+
+// ------------------------------------------------------------
+// 2. Add funds to users
+// ------------------------------------------------------------
+users.find("S100")->addFunds(20);
+users.find("ST200")->addFunds(10);
+users.find("TA300")->addFunds(5);
+
+cout << "\n=== Users After Adding Funds ===\n";
+for (const auto& u : users)
+    u->display();
+
+// ------------------------------------------------------------
+// 3. Create Library Items
+// ------------------------------------------------------------
+Catalog items;
+items.add(make_unique<Book>("B001","Effective C++"));
+items.add(make_unique<Magazine>("M010","Tech Monthly"));
+items.add(make_unique<DVD>("D100","C++ Patterns"));
+
+cout << "\n=== Library Items ===\n";
+for (const auto& it : items)
+    cout << it->id() << " | " << it->getTitle()
+         << " | " << it->typeName()
+         << " | fee/day: " << it->lateFeePerDay() << "\n";
+
+// ------------------------------------------------------------
+// 4. Simulate a Borrow Transaction
+// Student Amina returns a book 5 days late
+// ------------------------------------------------------------
+Person& borrower       = *users.find("S100");
+LibraryItem& borrowed  = *items.find("B001");
+
+BorrowTransaction tx(borrower, borrowed, 5);
+Money finalFee = tx.process();
+
+// ------------------------------------------------------------
+// 5. Display transaction summary
+// ------------------------------------------------------------
+cout << "\n=== Transaction Summary ===\n";
+cout << "User: " << tx.getUserId() << " | Item: " << tx.getItemId() << "\n";
+cout << "Days late: 5 | Fee charged: " << fixed << setprecision(2) << finalFee << "\n";
+cout << "Remaining balance: " << borrower.getBalance() << "\n";
+cout << "Transaction open: " << (tx.isOpened() ? "Yes" : "No") << "\n";
+
+return 0;
+
+}
+
+#endif // LIBRARY_BENCH / LIBRARY_SELFTEST